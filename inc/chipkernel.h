@@ -5,12 +5,153 @@
 #include <allegro5/allegro_audio.h>
 #include "libchip.h"
 #include <stdlib.h>
+
+// Index publishing between a single producer and a single consumer thread
+#define chip_atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define chip_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+// Waves and samples the renderer may still be reading when they're swapped
+// out. They wait on a list until the renderer has started a later sample.
+typedef struct chip_retired chip_retired;
+struct chip_retired
+{
+	chip_retired *next;
+	unsigned int epoch; // chip_render_epoch when swapped out
+	unsigned int kind;
+	size_t size; // Bytes freed along with it
+};
+
+#define CHIP_RETIRED_WAVE 1
+#define CHIP_RETIRED_SAMPLE 2
+
+// Wave data allocated by the library, retired like a sample once swapped out
+typedef struct chip_wave_buf chip_wave_buf;
+struct chip_wave_buf
+{
+	chip_retired retired; // Must come first
+	unsigned int len;
+	uint16_t data[];
+};
+
+// Descriptors per channel: the playing one, ones the renderer may still be
+// reading, and one the control thread leaves for the render thread
+#define CHIP_WAVE_SLOTS 4
+
+#define CHIP_WAVE_FREE 0
+#define CHIP_WAVE_LIVE 1 // Playing, or claimed for a swap
+#define CHIP_WAVE_RETIRED 2
+
+// Wave data and length as the renderer sees them, always swapped together.
+// A channel recycles its own descriptors, so swaps never allocate.
+struct chip_wave
+{
+	unsigned int state; // CHIP_WAVE_* in the low two bits, retire epoch above
+	unsigned int len;
+	uint16_t *data;
+	chip_wave_buf *buf; // Library-owned data, or NULL for user data
+};
+
+// Log ring geometry; the slot count must be a power of two
+#define CHIP_LOG_SLOTS 64
+#define CHIP_LOG_MSG_LEN 128
+
+// Highest log level compiled in. Debug messages cost nothing unless the
+// library is built with -DCHIP_LOG_MAX_LEVEL=CHIP_LOG_DEBUG.
+#ifndef CHIP_LOG_MAX_LEVEL
+#define CHIP_LOG_MAX_LEVEL CHIP_LOG_INFO
+#endif
+
+#define chip_log_error(...) chip_log(CHIP_LOG_ERROR, __VA_ARGS__)
+#define chip_log_warn(...) chip_log(CHIP_LOG_WARN, __VA_ARGS__)
+#if CHIP_LOG_MAX_LEVEL >= CHIP_LOG_INFO
+#define chip_log_info(...) chip_log(CHIP_LOG_INFO, __VA_ARGS__)
+#else
+#define chip_log_info(...) ((void)0)
+#endif
+#if CHIP_LOG_MAX_LEVEL >= CHIP_LOG_DEBUG
+#define chip_log_debug(...) chip_log(CHIP_LOG_DEBUG, __VA_ARGS__)
+#else
+#define chip_log_debug(...) ((void)0)
+#endif
+
+// Batched channel updates queued at once, across all pending batches
+#define CHIP_UPDATE_SLOTS 256
+
+// Adaptive fragment sizing thresholds, as a fraction of the fragment's
+// playback time spent rendering it
+#define CHIP_ADAPT_GROW_COST 0.75
+#define CHIP_ADAPT_SHRINK_COST 0.25
+#define CHIP_ADAPT_CLEAN_WINDOWS 4
+#define CHIP_ADAPT_MAX_HOLD 64 // Most quiet windows a failed shrink defers the next by
+
+// How often the sample thread tops up file-backed rings, in seconds
+#define CHIP_SAMPLE_POLL 0.01
+
+// How long chip_reconfigure and chip_resize_channels wait for the renderer
+// to take a new configuration, in seconds
+#define CHIP_CONFIG_TIMEOUT 2.0
+
+struct chip_sample
+{
+	chip_retired retired; // Must come first
+	unsigned int format;
+	unsigned int loop_en;
+	unsigned int done; // One-shot sample has played out
+
+	// Memory source, read directly by the audio thread
+	const uint8_t *mem;
+	unsigned int mem_len;
+	unsigned int mem_pos;
+
+	// File source, read ahead by the sample thread
+	FILE *file;
+	long offset; // Start of sample data within the file
+	uint8_t *ring; // CHIP_SAMPLE_CHUNKS * CHIP_SAMPLE_CHUNK_SIZE bytes
+	unsigned int chunk_len[CHIP_SAMPLE_CHUNKS];
+	unsigned int head; // Chunks filled, written by the sample thread
+	unsigned int tail; // Chunks consumed, written by the audio thread
+	unsigned int read_pos; // Byte offset within the tail chunk
+	unsigned int eof; // Sample thread has queued the last chunk
+	unsigned int underruns; // Samples where the ring ran dry
+
+	// Decoder state
+	unsigned int nybble_hi; // DPCM high nybble or PCM16 high byte is next
+	uint8_t dpcm_byte; // Byte in progress
+	int dpcm_acc;
+	unsigned int started; // Renderer has picked the sample up
+};
+
+// A configuration waiting for the rendering thread to switch to it
+typedef struct chip_config chip_config;
+struct chip_config
+{
+	unsigned int rate;
+	unsigned int frag_size;
+	unsigned int frag_num;
+	unsigned int rate_mul;
+	void *channel_block; // Replacement channel memory, or NULL to keep
+	chip_channel *channels;
+	chip_channel_state *channel_states;
+	unsigned int num_channels;
+	void *old_channel_block; // Memory swapped out, for the caller to free
+	chip_channel *old_channels;
+	unsigned int old_num_channels;
+};
+
 /* Internal workings */
 extern ALLEGRO_EVENT_QUEUE *chip_queue;
 extern ALLEGRO_AUDIO_STREAM *chip_stream;
 extern ALLEGRO_MIXER *chip_mixer;
 extern ALLEGRO_VOICE *chip_voice;
 extern ALLEGRO_THREAD *chip_thread;
+extern ALLEGRO_THREAD *chip_sample_thread;
+extern ALLEGRO_MUTEX *chip_sample_mutex;
+extern ALLEGRO_COND *chip_sample_cond;
+extern ALLEGRO_THREAD *chip_render_thread;
+extern ALLEGRO_MUTEX *chip_ahead_mutex;
+extern ALLEGRO_COND *chip_ahead_cond;
+extern ALLEGRO_MUTEX *chip_config_mutex;
+extern ALLEGRO_COND *chip_config_cond;
 
 extern unsigned int chip_rate;
 extern unsigned int chip_frag_size;
@@ -19,16 +160,119 @@ extern unsigned int chip_rate_mul;
 extern unsigned int chip_num_channels;
 
 extern int chip_is_init;
+extern int chip_is_started;
 
 // Libchip state
+extern int chip_is_offline; // Rendered by chip_render, with no device or threads
 extern void (*chip_engine_ptr)(void);
 extern unsigned int chip_engine_cnt;
 extern unsigned int chip_engine_period;
 extern chip_channel *chip_channels;
+extern chip_channel_state *chip_channel_states;
+extern void *chip_channel_block; // Single allocation holding both arrays
+extern unsigned int chip_render_epoch; // Bumped at the start of every sample
+extern size_t chip_retired_bytes; // Swapped out and not yet freed
+
+// Render-ahead ring; depth of 0 renders inside the fragment event instead
+extern unsigned int chip_ahead_depth;
+extern int16_t *chip_ahead_ring;
+extern unsigned int chip_ahead_head; // Fragments rendered
+extern unsigned int chip_ahead_tail; // Fragments handed to the stream
+extern unsigned int chip_ahead_misses; // Fragments the ring couldn't supply
+
+// Adaptive fragment sizing; a max of 0 keeps the fragment size fixed
+extern unsigned int chip_adapt_min;
+extern unsigned int chip_adapt_max;
+extern unsigned int chip_adapt_misses; // Fragment events that found the stream drained
+extern float chip_adapt_load; // Worst render cost of the last window
 
-void chip_noise_step(chip_channel *ch);
-void chip_channel_prog(chip_channel *ch);
+// Real-time setup for the rendering threads
+extern unsigned int chip_rt_policy;
+extern int chip_rt_priority;
+extern uint64_t chip_rt_cpus; // Bit n pins to CPU n; 0 leaves affinity alone
+extern unsigned int chip_rt_lock_mem;
+extern unsigned int chip_rt_applied; // CHIP_RT_* bits that took effect, set once chip_start returns
+
+// Logging
+extern unsigned int chip_log_level;
+extern chip_log_sink chip_log_sink_ptr;
+
+// Batched channel updates
+extern unsigned int chip_update_head; // Records published by the control thread
+extern unsigned int chip_update_tail; // Records applied by the renderer
+extern __thread int chip_in_engine; // Set on the rendering thread while the engine callback runs
+
+// Live reconfiguration
+extern chip_config chip_config_next;
+extern unsigned int chip_config_pending;
+extern unsigned int chip_channel_seq; // Odd while the channel arrays are swapped
+extern __thread int chip_is_render_thread; // Set on whichever thread runs chip_step
+
+void chip_noise_step(chip_channel *ch, chip_channel_state *st);
+void chip_channel_prog(chip_channel *ch, chip_channel_state *st, const chip_wave *w);
 void chip_step(int16_t *frame);
+void chip_render_fragment(int16_t *frame);
 void *chip_func(ALLEGRO_THREAD *thr, void *arg);
 
+// Render-ahead
+void chip_ahead_fill(void);
+void chip_ahead_pop(int16_t *frame);
+void chip_ahead_destroy(void);
+void *chip_render_func(ALLEGRO_THREAD *thr, void *arg);
+
+// Stream setup, shared by chip_init and adaptive resizing
+int chip_stream_setup(void);
+void chip_stream_destroy(void);
+
+// Adaptive fragment sizing
+void chip_adapt_begin(void);
+void chip_adapt_reset(void);
+void chip_adapt_check(void);
+void chip_adapt_account(double render_time);
+
+// Frequency to period, for chip_set_freq and batched updates
+uint32_t chip_freq_period(unsigned int len, float f);
+
+// Real-time setup
+void chip_rt_begin(void);
+void chip_rt_enter(int audio);
+void chip_rt_wait(unsigned int threads);
+void chip_rt_lock_memory(void);
+void chip_rt_unlock_memory(void);
+void chip_rt_lock(const void *p, size_t len);
+void chip_rt_unlock(const void *p, size_t len);
+
+// Logging
+void chip_log(unsigned int level, const char *fmt, ...);
+size_t chip_log_footprint(void);
+
+// Batched channel updates
+void chip_update_apply(void);
+void chip_update_reset(void);
+size_t chip_update_footprint(void);
+
+// Live reconfiguration
+void chip_config_apply(void);
+int chip_config_commit(void);
+
+// Sample streaming
+void chip_sample_prog(chip_channel *ch, chip_channel_state *st, chip_sample *s);
+void chip_sample_fill(chip_sample *s);
+void chip_sample_destroy(chip_sample *s);
+size_t chip_sample_size(const chip_sample *s);
+
+// Waves, and freeing what the renderer has let go of
+chip_wave_buf *chip_wave_buf_create(unsigned int len);
+int chip_wave_pool_create(chip_channel *ch);
+void chip_wave_pool_destroy(chip_channel *ch);
+void chip_wave_pool_lock(chip_channel *ch);
+size_t chip_wave_pool_footprint(chip_channel *ch);
+int chip_wave_swap(chip_channel *ch, uint16_t *data, unsigned int len, chip_wave_buf *buf);
+void chip_retire(chip_retired *r, unsigned int kind, size_t size);
+void chip_sample_retire(chip_sample *s);
+chip_sample *chip_sample_peek(chip_channel *ch);
+void chip_sample_unpeek(void);
+void chip_retired_reap(int all);
+void *chip_sample_func(ALLEGRO_THREAD *thr, void *arg);
+
 #endif
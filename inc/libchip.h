@@ -12,26 +12,109 @@
 #define CHIP_DEPTH ALLEGRO_AUDIO_DEPTH_INT16
 #define CHIP_CHAN ALLEGRO_CHANNEL_CONF_2
 
+// Sample formats for streaming sample channels
+#define CHIP_SAMPLE_DPCM4 1 // Packed 4-bit Fibonacci deltas, low nybble first
+#define CHIP_SAMPLE_PCM8 2 // Unsigned 8-bit PCM
+#define CHIP_SAMPLE_PCM16 3 // Signed 16-bit little-endian PCM
+
+// File-backed samples are read ahead into a ring of this many chunks
+#define CHIP_SAMPLE_CHUNKS 4
+#define CHIP_SAMPLE_CHUNK_SIZE 4096
+
+typedef struct chip_sample chip_sample;
+typedef struct chip_wave chip_wave;
+
+// Fields a chip_update record changes
+#define CHIP_UPDATE_PERIOD 0x01
+#define CHIP_UPDATE_FREQ 0x02 // Converted to a period, like chip_set_freq
+#define CHIP_UPDATE_AMP 0x04
+#define CHIP_UPDATE_NOISE 0x08
+#define CHIP_UPDATE_LOOP 0x10
+#define CHIP_UPDATE_WAVE 0x20 // Points at user-owned data, like chip_set_wave
+#define CHIP_UPDATE_WAVE_POS 0x40
+#define CHIP_UPDATE_NOISE_TAP 0x80
+
+// One channel's part of a chip_update_channels batch; only the fields
+// named in mask are used
+typedef struct chip_update chip_update;
+struct chip_update
+{
+	unsigned int channel;
+	unsigned int mask;
+	uint32_t period;
+	float freq;
+	unsigned int amplitude[2];
+	unsigned int noise_en;
+	unsigned int loop_en;
+	uint16_t *wave_data;
+	unsigned int wave_len;
+	unsigned int wave_pos;
+	unsigned int noise_tap;
+};
+
+// Scheduling policies for chip_set_realtime
+#define CHIP_RT_SCHED_OTHER 0
+#define CHIP_RT_SCHED_FIFO 1
+#define CHIP_RT_SCHED_RR 2
+
+// Settings reported by chip_get_realtime as having taken effect
+#define CHIP_RT_SCHED 0x01
+#define CHIP_RT_AFFINITY 0x02
+#define CHIP_RT_MLOCK 0x04
+
+// Log levels; messages above the current level are discarded
+#define CHIP_LOG_ERROR 0
+#define CHIP_LOG_WARN 1
+#define CHIP_LOG_INFO 2
+#define CHIP_LOG_DEBUG 3
+
+// Receives drained log messages, without a trailing newline. Messages are
+// queued without blocking from any thread, and handed to the sink by
+// chip_log_flush: the library flushes from init, start, shutdown and its
+// sample thread, never from the audio thread.
+typedef void (*chip_log_sink)(unsigned int level, const char *msg);
+
+// Channel memory is laid out in blocks of this size. State the audio thread
+// writes never shares a cache line with control settings, and each
+// channel's settings fill a line of their own.
+#define CHIP_CACHE_LINE 64
+
+// Render-owned channel state, advanced by the audio thread every sample
+typedef struct chip_channel_state chip_channel_state;
+struct chip_channel_state
+{
+	uint32_t counter; // Countdown until wave pos increment
+	unsigned int wave_pos; // Pointer within wave
+	unsigned int noise_state;
+	int sample_level; // Last decoded sample, signed 16-bit range
+};
+
+// Channel settings, written by the control side and read while rendering.
+// The renderer only follows wave and sample, which are swapped whole, so
+// it never needs a lock.
 typedef struct chip_channel chip_channel;
 struct chip_channel
 {
-	ALLEGRO_MUTEX *mutex; // Lock for reading/writing wave data
-	uint16_t *wave_data; // Pointer to wave nybbles array
+	chip_wave *wave; // The wave being rendered, one of waves
+	chip_wave *waves; // Descriptors the wave is swapped between
 	uint32_t period; // Division of sample rate / rate multiplier.
-	uint32_t counter; // Countdown until wave pos increment
 	unsigned int amplitude[2]; // Left and right amplitude;
-	unsigned int own_wave; // Mark if it should be destroyed
-	unsigned int wave_len; // Number of samples in the wave
-	unsigned int wave_pos; // Pointer within wave
 	unsigned int loop_en; // Will the wave loop at the end or stop playing?
 	unsigned int noise_en; // When nonzero, make LSFR noise like NES APU
-	unsigned int noise_state;
 	unsigned int noise_tap;
-};
+	chip_sample *sample; // Streaming sample source; NULL for wave/noise
+} __attribute__((aligned(CHIP_CACHE_LINE)));
 
 void chip_shutdown(void);
 void chip_init(unsigned int rate, unsigned int num_channels, unsigned int frag_size, unsigned int frag_num, unsigned int rate_mul);
 void chip_start(void);
+void chip_init_offline(unsigned int rate, unsigned int num_channels, unsigned int rate_mul);
+void chip_render(int16_t *buf, unsigned int frames);
+void chip_reconfigure(unsigned int rate, unsigned int frag_size, unsigned int frag_num, unsigned int rate_mul);
+void chip_resize_channels(unsigned int num_channels);
+void chip_set_render_ahead(unsigned int depth);
+void chip_set_adaptive(unsigned int min_size, unsigned int max_size);
+void chip_set_realtime(unsigned int policy, int priority, uint64_t cpu_mask, unsigned int lock_mem);
 
 void chip_set_engine_ptr(void *ptr, uint32_t p);
 void *chip_get_engine_ptr(void);
@@ -45,6 +128,17 @@ void chip_set_wave(unsigned int channel, uint16_t *wave_data, unsigned int len,
 void chip_create_wave(unsigned int channel, unsigned int len, unsigned int loop_en);
 void chip_set_wave_pos(unsigned int channel, unsigned int pos);
 void chip_set_noise_tap(unsigned int channel, unsigned int tap);
+void chip_set_sample_mem(unsigned int channel, const void *data, unsigned int len, unsigned int format, unsigned int loop_en);
+void chip_set_sample_file(unsigned int channel, const char *path, long offset, unsigned int format, unsigned int loop_en);
+void chip_set_sample_rate(unsigned int channel, float f);
+void chip_stop_sample(unsigned int channel);
+
+int chip_update_channels(const chip_update *updates, unsigned int count);
+
+void chip_set_log_sink(chip_log_sink sink);
+void chip_set_log_level(unsigned int level);
+void chip_log_flush(void);
+void chip_log_default_sink(unsigned int level, const char *msg);
 
 unsigned int chip_get_period(uint32_t channel);
 unsigned int chip_get_amp(unsigned int channel, unsigned int side);
@@ -55,5 +149,13 @@ unsigned int chip_get_wave_len(unsigned int channel);
 chip_channel *chip_get_channel(unsigned int channel);
 unsigned int chip_get_wave_pos(unsigned int channel);
 unsigned int chip_get_noise_tap(unsigned int channel);
+unsigned int chip_get_sample_playing(unsigned int channel);
+unsigned int chip_get_render_ahead(void);
+unsigned int chip_get_render_misses(void);
+unsigned int chip_get_frag_size(void);
+unsigned int chip_get_adaptive_misses(void);
+float chip_get_render_load(void);
+size_t chip_get_memory_footprint(void);
+unsigned int chip_get_realtime(void);
 
 #endif
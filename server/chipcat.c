@@ -0,0 +1,160 @@
+// LibChip render server client
+// Plays an arpeggio on a chipd chip and writes the audio to stdout as raw
+// signed 16-bit stereo, e.g. for `chipcat | aplay -f cd`
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "chipd.h"
+
+#define EX_RATE 44100
+#define EX_SECONDS 4
+#define EX_NOTE_FRAMES (EX_RATE / 8)
+
+static uint16_t wave_tri[] = {
+	0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7,
+	0x8, 0x9, 0xA, 0xB, 0xC, 0xD, 0xE, 0xF,
+	0xF, 0xE, 0xD, 0xC, 0xB, 0xA, 0x9, 0x8,
+	0x7, 0x6, 0x5, 0x4, 0x3, 0x2, 0x1, 0x0,
+};
+
+static float notes[] = { 220.0f, 277.18f, 329.63f, 440.0f };
+
+static void send_cmd(int fd, unsigned int op, unsigned int channel, uint32_t a, uint32_t b)
+{
+	chipd_cmd cmd;
+	cmd.op = op;
+	cmd.channel = channel;
+	cmd.a = a;
+	cmd.b = b;
+	if (write(fd, &cmd, sizeof(cmd)) != sizeof(cmd))
+	{
+		perror("chipcat: write");
+		exit(1);
+	}
+}
+
+static void send_freq(int fd, unsigned int channel, float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	send_cmd(fd, CHIPD_FREQ, channel, bits, 0);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = (argc > 1) ? argv[1] : CHIPD_SOCKET;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		perror("chipcat: connect");
+		return 1;
+	}
+
+	chipd_hello hello;
+	hello.magic = CHIPD_MAGIC;
+	hello.rate = EX_RATE;
+	hello.num_channels = 2;
+	hello.rate_mul = 8;
+	hello.ring_frames = 0;
+	hello.lead_frames = 0;
+	chipd_reply reply;
+	if (write(fd, &hello, sizeof(hello)) != sizeof(hello) ||
+		read(fd, &reply, sizeof(reply)) != sizeof(reply) || !reply.ok)
+	{
+		fprintf(stderr, "chipcat: server refused setup\n");
+		return 1;
+	}
+
+	int shm = shm_open(reply.name, O_RDWR, 0);
+	if (shm < 0)
+	{
+		perror("chipcat: shm_open");
+		return 1;
+	}
+	chipd_ring *ring = (chipd_ring *)mmap(NULL, sizeof(chipd_ring), PROT_READ, MAP_SHARED, shm, 0);
+	if (ring == MAP_FAILED)
+	{
+		perror("chipcat: mmap");
+		return 1;
+	}
+	size_t size = sizeof(chipd_ring) + (size_t)ring->frames * 2 * sizeof(int16_t);
+	munmap(ring, sizeof(chipd_ring));
+	ring = (chipd_ring *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+	close(shm);
+	if (ring == MAP_FAILED)
+	{
+		perror("chipcat: mmap");
+		return 1;
+	}
+
+	// Channel 0 carries the tune, channel 1 a quiet noise hat
+	unsigned int len = sizeof(wave_tri) / sizeof(uint16_t);
+	send_cmd(fd, CHIPD_WAVE, 0, len, 1);
+	if (write(fd, wave_tri, sizeof(wave_tri)) != sizeof(wave_tri))
+	{
+		perror("chipcat: write");
+		return 1;
+	}
+	send_cmd(fd, CHIPD_AMP, 0, 0xF, 0xF);
+	send_cmd(fd, CHIPD_NOISE, 1, 1, 0);
+	send_cmd(fd, CHIPD_PERIOD, 1, 40, 0);
+
+	const struct timespec nap = { 0, 1000000 };
+	uint32_t total = EX_RATE * EX_SECONDS;
+	uint32_t played = 0;
+	unsigned int note = 0;
+	while (played < total)
+	{
+		if (played >= note * EX_NOTE_FRAMES)
+		{
+			send_freq(fd, 0, notes[note % 4]);
+			send_cmd(fd, CHIPD_AMP, 1, (note % 2) ? 0 : 4, (note % 2) ? 0 : 4);
+			note++;
+		}
+		uint32_t tail = ring->tail;
+		uint32_t avail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+		if (!avail)
+		{
+			nanosleep(&nap, NULL);
+			continue;
+		}
+		// Stop at the end of the ring, and at the next note so it's sent
+		// before any later frames are taken. The server renders only a
+		// short lead past tail, so the note is heard within that lead of
+		// where it was meant to start.
+		uint32_t run = ring->frames - (tail & (ring->frames - 1));
+		uint32_t to_note = note * EX_NOTE_FRAMES - played;
+		if (to_note > total - played)
+		{
+			to_note = total - played;
+		}
+		if (avail > run)
+		{
+			avail = run;
+		}
+		if (avail > to_note)
+		{
+			avail = to_note;
+		}
+		fwrite(chipd_ring_frame(ring, tail), 2 * sizeof(int16_t), avail, stdout);
+		__atomic_store_n(&ring->tail, tail + avail, __ATOMIC_RELEASE);
+		played += avail;
+	}
+
+	munmap(ring, size);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,471 @@
+// LibChip render server
+// Hosts one chip per client, each in its own process so they render in
+// parallel across cores, and streams the audio over shared memory.
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <libchip.h>
+#include "chipd.h"
+
+#define CHIPD_DEFAULT_FRAMES 8192
+#define CHIPD_DEFAULT_LEAD 1024 // About 23ms at 44.1kHz
+#define CHIPD_BLOCK 256 // Frames rendered between command checks
+#define CHIPD_BATCH 64 // Register writes applied together at most
+#define CHIPD_MAX_CHANNELS 256
+#define CHIPD_MAX_CLIENTS 64 // Client processes alive at once
+#define CHIPD_READ_TIMEOUT 5 // Seconds a client may stall mid-record, hello included
+
+static volatile sig_atomic_t chipd_clients; // Client processes not yet reaped
+
+static chip_update chipd_batch[CHIPD_BATCH];
+static unsigned int chipd_batch_len;
+static unsigned int chipd_num_channels;
+static uint16_t **chipd_waves; // Per-channel wave buffers, filled by CHIPD_WAVE
+
+static int chipd_read_full(int fd, void *buf, size_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+	while (len)
+	{
+		ssize_t got = read(fd, p, len);
+		if (got < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (got <= 0)
+		{
+			return 0;
+		}
+		p += got;
+		len -= got;
+	}
+	return 1;
+}
+
+static int chipd_write_full(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	while (len)
+	{
+		ssize_t put = write(fd, p, len);
+		if (put < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (put <= 0)
+		{
+			return 0;
+		}
+		p += put;
+		len -= put;
+	}
+	return 1;
+}
+
+// Read a CHIPD_WAVE payload into the channel's buffer. The buffer is only
+// rewritten between renders, so the chip never sees half a wave.
+static int chipd_read_wave(int fd, const chipd_cmd *cmd, chip_update *u)
+{
+	uint16_t scratch[64];
+	uint32_t len = cmd->a;
+	if (cmd->channel >= chipd_num_channels || !len || len > CHIPD_MAX_WAVE)
+	{
+		fprintf(stderr, "chipd: bad wave for channel %d (length %d)\n", cmd->channel, len);
+		while (len)
+		{
+			uint32_t n = len < 64 ? len : 64;
+			if (!chipd_read_full(fd, scratch, n * sizeof(uint16_t)))
+			{
+				return 0;
+			}
+			len -= n;
+		}
+		u->mask = 0;
+		return 1;
+	}
+	if (!chipd_waves[cmd->channel])
+	{
+		chipd_waves[cmd->channel] = (uint16_t *)calloc(CHIPD_MAX_WAVE, sizeof(uint16_t));
+		if (!chipd_waves[cmd->channel])
+		{
+			return 0;
+		}
+	}
+	if (!chipd_read_full(fd, chipd_waves[cmd->channel], len * sizeof(uint16_t)))
+	{
+		return 0;
+	}
+	u->mask = CHIP_UPDATE_WAVE | CHIP_UPDATE_LOOP;
+	u->wave_data = chipd_waves[cmd->channel];
+	u->wave_len = len;
+	u->loop_en = cmd->b;
+	return 1;
+}
+
+// Turn one register write into a batch record. Returns 0 if the client
+// went away mid-record.
+static int chipd_command(int fd, const chipd_cmd *cmd)
+{
+	chip_update *u = &chipd_batch[chipd_batch_len];
+	memset(u, 0, sizeof(*u));
+	u->channel = cmd->channel;
+	switch (cmd->op)
+	{
+		case CHIPD_PERIOD:
+			u->mask = CHIP_UPDATE_PERIOD;
+			u->period = cmd->a;
+			break;
+		case CHIPD_FREQ:
+			memcpy(&u->freq, &cmd->a, sizeof(float));
+			u->mask = (u->freq > 0.0f) ? CHIP_UPDATE_FREQ : 0;
+			break;
+		case CHIPD_AMP:
+			u->mask = CHIP_UPDATE_AMP;
+			u->amplitude[0] = cmd->a;
+			u->amplitude[1] = cmd->b;
+			break;
+		case CHIPD_NOISE:
+			u->mask = CHIP_UPDATE_NOISE;
+			u->noise_en = cmd->a;
+			break;
+		case CHIPD_LOOP:
+			u->mask = CHIP_UPDATE_LOOP;
+			u->loop_en = cmd->a;
+			break;
+		case CHIPD_WAVE_POS:
+			u->mask = CHIP_UPDATE_WAVE_POS;
+			u->wave_pos = cmd->a;
+			break;
+		case CHIPD_NOISE_TAP:
+			u->mask = CHIP_UPDATE_NOISE_TAP;
+			u->noise_tap = cmd->a;
+			break;
+		case CHIPD_WAVE:
+			if (!chipd_read_wave(fd, cmd, u))
+			{
+				return 0;
+			}
+			break;
+		default:
+			fprintf(stderr, "chipd: unknown command %d\n", cmd->op);
+			break;
+	}
+	// One bad record is dropped here rather than failing the whole batch
+	if (u->mask && u->channel < chipd_num_channels)
+	{
+		chipd_batch_len++;
+	}
+	return 1;
+}
+
+// Take whatever register writes are waiting, up to a batch, and queue them
+// to land together before the next sample. Returns 0 once the client has
+// hung up.
+static int chipd_read_commands(int fd)
+{
+	chipd_batch_len = 0;
+	while (chipd_batch_len < CHIPD_BATCH)
+	{
+		chipd_cmd cmd;
+		if (!chipd_read_full(fd, &cmd, sizeof(cmd)) || !chipd_command(fd, &cmd))
+		{
+			return 0;
+		}
+		struct pollfd p;
+		p.fd = fd;
+		p.events = POLLIN;
+		if (poll(&p, 1, 0) <= 0 || !(p.revents & POLLIN))
+		{
+			break;
+		}
+	}
+	if (!chip_update_channels(chipd_batch, chipd_batch_len))
+	{
+		fprintf(stderr, "chipd: dropped a batch of %d writes\n", chipd_batch_len);
+	}
+	return 1;
+}
+
+static chipd_ring *chipd_ring_create(char *name, uint32_t rate, uint32_t frames, size_t *size)
+{
+	snprintf(name, CHIPD_NAME_LEN, "/chipd-%d", (int)getpid());
+	*size = sizeof(chipd_ring) + (size_t)frames * 2 * sizeof(int16_t);
+	int shm = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (shm < 0)
+	{
+		perror("chipd: shm_open");
+		return NULL;
+	}
+	if (ftruncate(shm, *size) != 0)
+	{
+		perror("chipd: ftruncate");
+		close(shm);
+		shm_unlink(name);
+		return NULL;
+	}
+	void *mem = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+	close(shm);
+	if (mem == MAP_FAILED)
+	{
+		perror("chipd: mmap");
+		shm_unlink(name);
+		return NULL;
+	}
+	chipd_ring *ring = (chipd_ring *)mem;
+	ring->rate = rate;
+	ring->frames = frames;
+	ring->head = 0;
+	ring->tail = 0;
+	__atomic_store_n(&ring->magic, CHIPD_MAGIC, __ATOMIC_RELEASE);
+	return ring;
+}
+
+static int chipd_hello_sanity(chipd_hello *h)
+{
+	if (h->magic != CHIPD_MAGIC || !h->rate || h->rate > CHIPD_MAX_RATE)
+	{
+		return 0;
+	}
+	if (!h->num_channels || h->num_channels > CHIPD_MAX_CHANNELS)
+	{
+		return 0;
+	}
+	if (!h->rate_mul || h->rate_mul > CHIPD_MAX_RATE_MUL)
+	{
+		return 0;
+	}
+	if (!h->ring_frames)
+	{
+		h->ring_frames = CHIPD_DEFAULT_FRAMES;
+	}
+	// Whole blocks must fit without wrapping
+	if (h->ring_frames < CHIPD_BLOCK || (h->ring_frames & (h->ring_frames - 1)))
+	{
+		return 0;
+	}
+	if (h->ring_frames > h->rate * CHIPD_MAX_RING_SECONDS)
+	{
+		return 0;
+	}
+	if (!h->lead_frames)
+	{
+		h->lead_frames = CHIPD_DEFAULT_LEAD;
+	}
+	if (h->lead_frames > h->ring_frames)
+	{
+		h->lead_frames = h->ring_frames;
+	}
+	// At least one block, so rendering can always make progress
+	if (h->lead_frames < CHIPD_BLOCK)
+	{
+		h->lead_frames = CHIPD_BLOCK;
+	}
+	return 1;
+}
+
+// Render ahead into the ring, up to lead frames past the client's tail,
+// applying its register writes between blocks, until it hangs up. Keeping
+// the lead short, rather than filling the ring, bounds how late a write
+// is heard.
+static void chipd_stream(int fd, chipd_ring *ring, uint32_t lead)
+{
+	for (;;)
+	{
+		uint32_t head = ring->head;
+		uint32_t space = lead - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+		struct pollfd p;
+		p.fd = fd;
+		p.revents = 0;
+		// With the lead used up, leave commands queued in the socket and
+		// look again in a millisecond
+		p.events = (space >= CHIPD_BLOCK) ? POLLIN : 0;
+		if (poll(&p, 1, (space >= CHIPD_BLOCK) ? 0 : 1) < 0 && errno != EINTR)
+		{
+			break;
+		}
+		if (p.revents & POLLIN)
+		{
+			if (!chipd_read_commands(fd))
+			{
+				break;
+			}
+		}
+		else if (p.revents & (POLLHUP | POLLERR))
+		{
+			break;
+		}
+		if (space >= CHIPD_BLOCK)
+		{
+			chip_render(chipd_ring_frame(ring, head), CHIPD_BLOCK);
+			__atomic_store_n(&ring->head, head + CHIPD_BLOCK, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+// Runs in the forked process for one client, which owns the library's
+// single chip instance for as long as the client stays connected
+static int chipd_serve(int fd)
+{
+	chipd_hello hello;
+	chipd_reply reply;
+	memset(&reply, 0, sizeof(reply));
+	reply.magic = CHIPD_MAGIC;
+	// A client that connects and never finishes a record is dropped,
+	// rather than holding a process forever
+	struct timeval timeout;
+	memset(&timeout, 0, sizeof(timeout));
+	timeout.tv_sec = CHIPD_READ_TIMEOUT;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (!chipd_read_full(fd, &hello, sizeof(hello)))
+	{
+		return 1;
+	}
+	if (!chipd_hello_sanity(&hello))
+	{
+		fprintf(stderr, "chipd: rejected client setup\n");
+		chipd_write_full(fd, &reply, sizeof(reply));
+		return 1;
+	}
+
+	chip_init_offline(hello.rate, hello.num_channels, hello.rate_mul);
+	chipd_num_channels = hello.num_channels;
+	chipd_waves = (uint16_t **)calloc(chipd_num_channels, sizeof(uint16_t *));
+	size_t ring_size;
+	chipd_ring *ring = NULL;
+	if (chip_get_channel(0) && chipd_waves)
+	{
+		ring = chipd_ring_create(reply.name, hello.rate, hello.ring_frames, &ring_size);
+	}
+	reply.ok = (ring != NULL);
+	if (chipd_write_full(fd, &reply, sizeof(reply)) && ring)
+	{
+		chipd_stream(fd, ring, hello.lead_frames);
+	}
+	if (ring)
+	{
+		munmap(ring, ring_size);
+		shm_unlink(reply.name);
+	}
+	chip_shutdown();
+	for (unsigned int i = 0; chipd_waves && i < chipd_num_channels; i++)
+	{
+		free(chipd_waves[i]);
+	}
+	free(chipd_waves);
+	close(fd);
+	return 0;
+}
+
+static void chipd_reap(int sig)
+{
+	(void)sig;
+	int saved = errno;
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+	{
+		chipd_clients--;
+	}
+	errno = saved;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = (argc > 1) ? argv[1] : CHIPD_SOCKET;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "chipd: socket path too long\n");
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd < 0)
+	{
+		perror("chipd: socket");
+		return 1;
+	}
+	unlink(path);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 16) != 0)
+	{
+		perror("chipd: bind");
+		return 1;
+	}
+
+	// Client processes are counted as they're forked and reaped
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = chipd_reap;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	sigset_t chld;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+
+	// Forks inherit this; they only need to report trouble
+	chip_set_log_level(CHIP_LOG_WARN);
+
+	printf("chipd: listening on %s\n", path);
+	for (;;)
+	{
+		int fd = accept(lfd, NULL, NULL);
+		if (fd < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			perror("chipd: accept");
+			break;
+		}
+		// The count only changes in the handler while SIGCHLD is let through
+		sigprocmask(SIG_BLOCK, &chld, NULL);
+		if (chipd_clients >= CHIPD_MAX_CLIENTS)
+		{
+			sigprocmask(SIG_UNBLOCK, &chld, NULL);
+			fprintf(stderr, "chipd: turned a client away, %d already connected\n", CHIPD_MAX_CLIENTS);
+			chipd_reply reply;
+			memset(&reply, 0, sizeof(reply));
+			reply.magic = CHIPD_MAGIC;
+			chipd_write_full(fd, &reply, sizeof(reply));
+			close(fd);
+			continue;
+		}
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			sigprocmask(SIG_UNBLOCK, &chld, NULL);
+			close(lfd);
+			return chipd_serve(fd);
+		}
+		if (pid < 0)
+		{
+			perror("chipd: fork");
+		}
+		else
+		{
+			chipd_clients++;
+		}
+		sigprocmask(SIG_UNBLOCK, &chld, NULL);
+		close(fd);
+	}
+	close(lfd);
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,95 @@
+// LibChip render server protocol
+// Shared by chipd and its clients. The server forks a process for each
+// client that connects, so every client gets a chip of its own.
+
+#ifndef CHIPD_H
+#define CHIPD_H
+
+#include <stdint.h>
+
+#define CHIPD_MAGIC 0x44504843 // "CHPD"
+#define CHIPD_SOCKET "/tmp/chipd.sock"
+#define CHIPD_NAME_LEN 32
+
+// Cap on wave length accepted from a client, in nybbles
+#define CHIPD_MAX_WAVE 4096
+
+// Ring offsets are kept a cache line apart so the server and the client
+// never write the same line
+#define CHIPD_LINE 64
+
+// Limits on what a client may ask for
+#define CHIPD_MAX_RATE 192000
+#define CHIPD_MAX_RATE_MUL 512
+#define CHIPD_MAX_RING_SECONDS 2
+
+// Sent by the client right after connecting. ring_frames must be a power
+// of two no longer than CHIPD_MAX_RING_SECONDS of audio. The server never
+// renders more than lead_frames past the client's tail, so a register write
+// is heard at most that many frames after the client sends it. 0 picks the
+// default for either.
+typedef struct chipd_hello chipd_hello;
+struct chipd_hello
+{
+	uint32_t magic;
+	uint32_t rate;
+	uint32_t num_channels;
+	uint32_t rate_mul;
+	uint32_t ring_frames;
+	uint32_t lead_frames;
+};
+
+// The server's answer. On success, name is the POSIX shared memory object
+// holding this client's chipd_ring. ok is 0 if the setup was rejected or
+// the server already has as many clients as it takes.
+typedef struct chipd_reply chipd_reply;
+struct chipd_reply
+{
+	uint32_t magic;
+	uint32_t ok;
+	char name[CHIPD_NAME_LEN];
+};
+
+// Register writes, one per chipd_cmd. Records that arrive together are
+// applied together, between two samples.
+#define CHIPD_PERIOD 1 // a = period
+#define CHIPD_FREQ 2 // a = frequency, as the bits of a float
+#define CHIPD_AMP 3 // a = left, b = right
+#define CHIPD_NOISE 4 // a = noise enable
+#define CHIPD_LOOP 5 // a = loop enable
+#define CHIPD_WAVE_POS 6 // a = position
+#define CHIPD_NOISE_TAP 7 // a = tap
+#define CHIPD_WAVE 8 // a = length, b = loop; followed by a uint16_t per nybble
+
+typedef struct chipd_cmd chipd_cmd;
+struct chipd_cmd
+{
+	uint16_t op;
+	uint16_t channel;
+	uint32_t a;
+	uint32_t b;
+};
+
+// Interleaved stereo int16 frames, written by the server at head and read
+// by the client at tail. Each side publishes its offset with a release
+// store and reads the other's with an acquire load; neither ever blocks.
+typedef struct chipd_ring chipd_ring;
+struct chipd_ring
+{
+	uint32_t magic;
+	uint32_t rate;
+	uint32_t frames; // Capacity, a power of two
+	uint8_t pad0[CHIPD_LINE - 3 * sizeof(uint32_t)];
+	uint32_t head; // Frames written, wrapping
+	uint8_t pad1[CHIPD_LINE - sizeof(uint32_t)];
+	uint32_t tail; // Frames read, wrapping
+	uint8_t pad2[CHIPD_LINE - sizeof(uint32_t)];
+	int16_t data[];
+};
+
+static inline int16_t *chipd_ring_frame(chipd_ring *r, uint32_t pos)
+{
+	return &r->data[2 * (pos & (r->frames - 1))];
+}
+
+#endif
@@ -0,0 +1,131 @@
+#include "chipkernel.h"
+
+unsigned int chip_adapt_min;
+unsigned int chip_adapt_max;
+unsigned int chip_adapt_misses;
+float chip_adapt_load;
+
+static double chip_adapt_worst; // Worst render cost this window, 1.0 = deadline
+static unsigned int chip_adapt_window; // Samples rendered this window
+static unsigned int chip_adapt_window_misses;
+static unsigned int chip_adapt_clean; // Consecutive windows fit to shrink
+static unsigned int chip_adapt_settle; // Fragments to skip after a rebuild
+static unsigned int chip_adapt_hold; // Quiet windows needed before a shrink
+static unsigned int chip_adapt_probation; // Windows in which growing undoes the last shrink
+
+// Called when adaptive sizing is turned on
+void chip_adapt_begin(void)
+{
+	chip_adapt_hold = CHIP_ADAPT_CLEAN_WINDOWS;
+	chip_adapt_probation = 0;
+	chip_adapt_reset();
+}
+
+void chip_adapt_reset(void)
+{
+	chip_adapt_worst = 0.0;
+	chip_adapt_window = 0;
+	chip_adapt_window_misses = 0;
+	chip_adapt_clean = 0;
+	// A fresh stream starts with every fragment free; that isn't a miss
+	chip_adapt_settle = chip_frag_num;
+}
+
+// Called from the fragment event, before the fragment is taken. If every
+// fragment is already free, the device has played everything we gave it.
+void chip_adapt_check(void)
+{
+	if (chip_adapt_settle)
+	{
+		chip_adapt_settle--;
+		return;
+	}
+	if (al_get_available_audio_stream_fragments(chip_stream) >= chip_frag_num)
+	{
+		chip_adapt_misses++;
+		chip_adapt_window_misses++;
+	}
+}
+
+// Swap in a stream with a new fragment size. Called between fragments;
+// what's queued plays out first, like a reconfigure. Channel state is
+// untouched, so playback carries on from the same position in every
+// channel.
+static void chip_adapt_resize(unsigned int frag_size)
+{
+	unsigned int old_size = chip_frag_size;
+	al_drain_audio_stream(chip_stream);
+	chip_stream_destroy();
+	chip_frag_size = frag_size;
+	if (!chip_stream_setup())
+	{
+		chip_log_error("Couldn't rebuild stream, reverting to %d.",old_size);
+		chip_stream_destroy();
+		chip_frag_size = old_size;
+		chip_stream_setup();
+	}
+	chip_adapt_reset();
+}
+
+// Called from the fragment event after a fragment is rendered, with the
+// time it took. Every half second, grow the fragments if a deadline was
+// missed or came close, and shrink them after a run of quiet windows.
+void chip_adapt_account(double render_time)
+{
+	double cost = render_time * chip_rate / chip_frag_size;
+	if (cost > chip_adapt_worst)
+	{
+		chip_adapt_worst = cost;
+	}
+	chip_adapt_window += chip_frag_size;
+	if (chip_adapt_window < chip_rate / 2)
+	{
+		return;
+	}
+
+	chip_adapt_load = (float)chip_adapt_worst;
+	if (chip_adapt_window_misses || chip_adapt_worst > CHIP_ADAPT_GROW_COST)
+	{
+		if (chip_frag_size < chip_adapt_max)
+		{
+			if (chip_adapt_probation)
+			{
+				// The last shrink didn't hold; try the next one later
+				chip_adapt_hold *= 2;
+				if (chip_adapt_hold > CHIP_ADAPT_MAX_HOLD)
+				{
+					chip_adapt_hold = CHIP_ADAPT_MAX_HOLD;
+				}
+				chip_adapt_probation = 0;
+				chip_log_info("Fragment size %d missed; next shrink after %d quiet windows.",chip_frag_size,chip_adapt_hold);
+			}
+			unsigned int size = chip_frag_size * 2;
+			chip_adapt_resize(size > chip_adapt_max ? chip_adapt_max : size);
+			return;
+		}
+		chip_adapt_clean = 0;
+	}
+	else if (chip_adapt_worst < CHIP_ADAPT_SHRINK_COST)
+	{
+		chip_adapt_clean++;
+		if (chip_adapt_clean >= chip_adapt_hold && chip_frag_size > chip_adapt_min)
+		{
+			chip_adapt_probation = CHIP_ADAPT_CLEAN_WINDOWS;
+			unsigned int size = chip_frag_size / 2;
+			chip_adapt_resize(size < chip_adapt_min ? chip_adapt_min : size);
+			return;
+		}
+	}
+	else
+	{
+		chip_adapt_clean = 0;
+	}
+	if (chip_adapt_probation && !--chip_adapt_probation)
+	{
+		// The shrink held
+		chip_adapt_hold = CHIP_ADAPT_CLEAN_WINDOWS;
+	}
+	chip_adapt_worst = 0.0;
+	chip_adapt_window = 0;
+	chip_adapt_window_misses = 0;
+}
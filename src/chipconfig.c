@@ -0,0 +1,128 @@
+#include "chipkernel.h"
+#include <string.h>
+
+ALLEGRO_MUTEX *chip_config_mutex;
+ALLEGRO_COND *chip_config_cond;
+
+chip_config chip_config_next;
+unsigned int chip_config_pending;
+unsigned int chip_channel_seq;
+
+// Switch to chip_config_next. Runs on whichever thread renders, between
+// fragments, so no fragment is ever rendered half in the old setup.
+void chip_config_apply(void)
+{
+	al_lock_mutex(chip_config_mutex);
+	chip_config *c = &chip_config_next;
+	if (chip_is_started && !chip_atomic_load(&chip_config_pending))
+	{
+		// The commit gave up waiting and took it back
+		al_unlock_mutex(chip_config_mutex);
+		return;
+	}
+
+	// Periods count ticks of rate * rate_mul; rescale them to keep pitch
+	if (c->rate != chip_rate || c->rate_mul != chip_rate_mul)
+	{
+		double scale = ((double)c->rate * c->rate_mul) / ((double)chip_rate * chip_rate_mul);
+		for (unsigned int i = 0; i < chip_num_channels; i++)
+		{
+			chip_channel *ch = &chip_channels[i];
+			chip_channel_state *st = &chip_channel_states[i];
+			uint32_t period = (uint32_t)(ch->period * scale);
+			ch->period = period ? period : 1;
+			if (st->counter >= ch->period)
+			{
+				st->counter = ch->period - 1;
+			}
+		}
+		// Engine period is in output samples; keep its rate in Hz
+		unsigned int eng_period = (unsigned int)(((double)chip_engine_period * c->rate) / chip_rate);
+		chip_engine_period = eng_period ? eng_period : 1;
+		if (chip_engine_cnt >= chip_engine_period)
+		{
+			chip_engine_cnt = chip_engine_period - 1;
+		}
+	}
+
+	// Carry surviving channels over into the new array
+	if (c->channel_block)
+	{
+		unsigned int keep = c->num_channels < chip_num_channels ? c->num_channels : chip_num_channels;
+		memcpy(c->channels, chip_channels, keep * sizeof(chip_channel));
+		memcpy(c->channel_states, chip_channel_states, keep * sizeof(chip_channel_state));
+		c->old_channel_block = chip_channel_block;
+		c->old_channels = chip_channels;
+		c->old_num_channels = chip_num_channels;
+		// The sample thread reads the array and its length without a lock
+		unsigned int seq = chip_channel_seq;
+		__atomic_store_n(&chip_channel_seq, seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		chip_channel_block = c->channel_block;
+		__atomic_store_n(&chip_channels, c->channels, __ATOMIC_RELAXED);
+		chip_channel_states = c->channel_states;
+		__atomic_store_n(&chip_num_channels, c->num_channels, __ATOMIC_RELAXED);
+		chip_atomic_store(&chip_channel_seq, seq + 2);
+		c->channel_block = NULL;
+	}
+
+	int rebuild = (c->rate != chip_rate || c->frag_size != chip_frag_size || c->frag_num != chip_frag_num);
+	chip_rate = c->rate;
+	chip_rate_mul = c->rate_mul;
+	chip_frag_size = c->frag_size;
+	chip_frag_num = c->frag_num;
+	if (rebuild && !chip_is_offline)
+	{
+		// Let what's queued play out rather than cutting it off; the new
+		// stream starts empty, so there's still a short gap while its
+		// first fragment fills. The voice and mixer stay; the mixer
+		// resamples a new stream rate.
+		if (chip_stream)
+		{
+			al_drain_audio_stream(chip_stream);
+		}
+		chip_stream_destroy();
+		if (!chip_stream_setup())
+		{
+			chip_log_error("Couldn't rebuild stream for new configuration.");
+		}
+		if (chip_adapt_max)
+		{
+			chip_adapt_reset();
+		}
+	}
+
+	chip_atomic_store(&chip_config_pending, 0);
+	al_broadcast_cond(chip_config_cond);
+	al_unlock_mutex(chip_config_mutex);
+}
+
+// Hand chip_config_next to the rendering thread and wait for it to be
+// applied. Before chip_start nothing is rendering, so apply it here.
+// Returns 0 if the renderer didn't take it within CHIP_CONFIG_TIMEOUT, in
+// which case nothing changed.
+int chip_config_commit(void)
+{
+	if (!chip_is_started)
+	{
+		chip_config_apply();
+		return 1;
+	}
+	ALLEGRO_TIMEOUT timeout;
+	al_init_timeout(&timeout, CHIP_CONFIG_TIMEOUT);
+	al_lock_mutex(chip_config_mutex);
+	chip_atomic_store(&chip_config_pending, 1);
+	while (chip_atomic_load(&chip_config_pending))
+	{
+		if (al_wait_cond_until(chip_config_cond, chip_config_mutex, &timeout))
+		{
+			break;
+		}
+	}
+	// Still pending means it timed out; withdraw it under the lock, so
+	// the renderer can't pick it up after we return
+	int ok = !chip_atomic_load(&chip_config_pending);
+	chip_atomic_store(&chip_config_pending, 0);
+	al_unlock_mutex(chip_config_mutex);
+	return ok;
+}
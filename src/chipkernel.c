@@ -1,4 +1,5 @@
 #include "chipkernel.h"
+#include <string.h>
 
 /* Internal workings */
 ALLEGRO_EVENT_QUEUE *chip_queue;
@@ -14,48 +15,54 @@ unsigned int chip_rate_mul;
 unsigned int chip_num_channels;
 
 int chip_is_init;
+int chip_is_started;
+int chip_is_offline;
+__thread int chip_is_render_thread;
 
 void (*chip_engine_ptr)(void);
 unsigned int chip_engine_cnt;
 unsigned int chip_engine_period;
 
 chip_channel *chip_channels;
+chip_channel_state *chip_channel_states;
+void *chip_channel_block;
+unsigned int chip_render_epoch;
 
-void chip_noise_step(chip_channel *ch)
+void chip_noise_step(chip_channel *ch, chip_channel_state *st)
 {
-	uint16_t feedback = (ch->noise_state & 0x0001) ^ ((ch->noise_state & (1 << ch->noise_tap)) ? 1 : 0);
-	ch->noise_state = (feedback << 14) | (ch->noise_state >> 1);
+	uint16_t feedback = (st->noise_state & 0x0001) ^ ((st->noise_state & (1 << ch->noise_tap)) ? 1 : 0);
+	st->noise_state = (feedback << 14) | (st->noise_state >> 1);
 }
 
-void chip_channel_prog(chip_channel *ch)
+void chip_channel_prog(chip_channel *ch, chip_channel_state *st, const chip_wave *w)
 {
 	// Period met, increment wave pointer
-	if (ch->counter == 0)
+	if (st->counter == 0)
 	{
 		// Reset period counter
-		ch->counter = ch->period - 1;
+		st->counter = ch->period - 1;
 
 		if (ch->noise_en)
 		{
-			chip_noise_step(ch);
+			chip_noise_step(ch, st);
 		}
 
 		// Loop the wave if necessary
-		if (ch->wave_pos >= ch->wave_len - 1)
+		if (st->wave_pos >= w->len - 1)
 		{
 			if (ch->loop_en)
 			{
-				ch->wave_pos = 0;
+				st->wave_pos = 0;
 			}
 		}
 		else
 		{
-			ch->wave_pos++;
+			st->wave_pos++;
 		}
 	}
 	else
 	{
-		ch->counter--;
+		st->counter--;
 	}
 }
 
@@ -63,13 +70,24 @@ void chip_channel_prog(chip_channel *ch)
 void chip_step(int16_t *frame)
 {
 	memset(frame, 0, sizeof(int16_t) * 2);
+	// Lets swapped-out waves and samples be freed once this sample is done.
+	// Sequentially consistent so that the channel reads below can't be
+	// seen before it.
+	__atomic_store_n(&chip_render_epoch, chip_render_epoch + 1, __ATOMIC_SEQ_CST);
+	// Batched channel updates land between samples, all at once
+	if (chip_update_tail != chip_atomic_load(&chip_update_head))
+	{
+		chip_update_apply();
+	}
 	// If there's an attached sound engine, call its function
 	if (chip_engine_ptr)
 	{
 		if (chip_engine_cnt == 0)
 		{
 			chip_engine_cnt = chip_engine_period - 1;
+			chip_in_engine = 1;
 			chip_engine_ptr();
+			chip_in_engine = 0;
 		}
 		else
 		{
@@ -80,7 +98,27 @@ void chip_step(int16_t *frame)
 	for (unsigned int i = 0; i < chip_num_channels; i++)
 	{
 		chip_channel *ch = &chip_channels[i];
-		al_lock_mutex(ch->mutex);
+		chip_channel_state *st = &chip_channel_states[i];
+		chip_sample *s = __atomic_load_n(&ch->sample, __ATOMIC_SEQ_CST);
+		if (s)
+		{
+			// Samples are already signed 16-bit; average, scale by the
+			// nybble amplitude, and share headroom like the wave path
+			int32_t level = 0;
+			for (unsigned int k = 0; k < chip_rate_mul; k++)
+			{
+				chip_sample_prog(ch, st, s);
+				level += st->sample_level;
+			}
+			level /= (int32_t)chip_rate_mul;
+			for (unsigned int k = 0; k < 2; k++)
+			{
+				int32_t out = (level * (int32_t)ch->amplitude[k]) / 0xF;
+				frame[k] += (int16_t)(out / (int32_t)chip_num_channels);
+			}
+			continue;
+		}
+		const chip_wave *w = __atomic_load_n(&ch->wave, __ATOMIC_SEQ_CST);
 		int16_t frame_add[2];
 		frame_add[0] = 0;
 		frame_add[1] = 0;
@@ -88,14 +126,15 @@ void chip_step(int16_t *frame)
 		// Rate multiplier is for oversampling and averaging
 		for (unsigned int k = 0; k < chip_rate_mul; k++)
 		{
-			chip_channel_prog(ch);
+			chip_channel_prog(ch, st, w);
 			if (ch->noise_en)
 			{
-				frame_add[0] += 0xF * (ch->noise_state & 0x0001);
+				frame_add[0] += 0xF * (st->noise_state & 0x0001);
 			}
 			else
 			{
-				frame_add[0] += ch->wave_data[ch->wave_pos];
+				// A shorter wave may have been swapped in mid-play
+				frame_add[0] += w->data[(st->wave_pos < w->len) ? st->wave_pos : w->len - 1];
 			}
 		}
 		frame_add[1] = frame_add[0];
@@ -112,43 +151,76 @@ void chip_step(int16_t *frame)
 			frame_add[k] /= chip_num_channels;
 			frame[k] += (int16_t)frame_add[k];
 		}
-		al_unlock_mutex(ch->mutex);
+	}
+}
+
+void chip_render_fragment(int16_t *frame)
+{
+	for (unsigned int i = 0; i < chip_frag_size; i++)
+	{
+		chip_step(frame + (2*i));
 	}
 }
 
 void* chip_func(ALLEGRO_THREAD *thr, void *arg)
 {
 	int16_t *frame;
+	double render_start;
+	chip_is_render_thread = 1;
+	chip_rt_enter(1);
 	while (!al_get_thread_should_stop(thr))
 	{
 		ALLEGRO_TIMEOUT ev_timeout;
 		ALLEGRO_EVENT event;
 		al_init_timeout(&ev_timeout, 1.0);
 		int got_ev = al_wait_for_event_until(chip_queue, &event, &ev_timeout);
+		if (!got_ev && !chip_ahead_depth && chip_atomic_load(&chip_config_pending))
+		{
+			// No stream to raise events, e.g. after a failed rebuild; a
+			// new configuration may bring one back
+			chip_config_apply();
+		}
 		if (got_ev)
 		{
 			switch (event.type)
 			{
 				case ALLEGRO_EVENT_AUDIO_STREAM_FRAGMENT:
+					if (!chip_ahead_depth && chip_atomic_load(&chip_config_pending))
+					{
+						chip_config_apply();
+					}
+					if (chip_adapt_max)
+					{
+						chip_adapt_check();
+					}
 					frame = (int16_t *)al_get_audio_stream_fragment(chip_stream);
+					render_start = al_get_time();
 					if (frame)
 					{
-						for (unsigned int i = 0; i < chip_frag_size; i++)
+						if (chip_ahead_depth)
+						{
+							chip_ahead_pop(frame);
+						}
+						else
 						{
-							chip_step(frame + (2*i));
+							chip_render_fragment(frame);
 						}
 					}
 					al_set_audio_stream_fragment(chip_stream, (void *)frame);
+					if (frame && chip_adapt_max)
+					{
+						chip_adapt_account(al_get_time() - render_start);
+					}
 					break;
 					
 				case ALLEGRO_EVENT_AUDIO_STREAM_FINISHED:
-					printf("[audio] Stream has finished.\n");	
+					chip_log_info("Stream has finished.");	
 					al_drain_audio_stream(chip_stream);
 					break;
 			}
 		}
 	}
-	printf("[audio] Thread received signal to stop.\n");
+	chip_log_info("Thread received signal to stop.");
 	return NULL;
 }
 
@@ -0,0 +1,136 @@
+#include "chipkernel.h"
+#include <stdarg.h>
+
+// One queued message. seq tells producers and the drain whose turn the
+// slot is, so any thread can log without taking a lock. It is stored
+// relative to the slot's index so the zeroed ring starts out all free.
+typedef struct chip_log_slot chip_log_slot;
+struct chip_log_slot
+{
+	unsigned int seq;
+	unsigned int level;
+	char msg[CHIP_LOG_MSG_LEN];
+};
+
+static chip_log_slot chip_log_ring[CHIP_LOG_SLOTS];
+static unsigned int chip_log_write;
+static unsigned int chip_log_read;
+static unsigned int chip_log_dropped;
+static unsigned int chip_log_draining;
+
+unsigned int chip_log_level = CHIP_LOG_INFO;
+chip_log_sink chip_log_sink_ptr = chip_log_default_sink;
+
+void chip_log_default_sink(unsigned int level, const char *msg)
+{
+	switch (level)
+	{
+		case CHIP_LOG_ERROR:
+			fprintf(stderr,"[audio] Error: %s\n",msg);
+			break;
+		case CHIP_LOG_WARN:
+			fprintf(stderr,"[audio] Warning: %s\n",msg);
+			break;
+		default:
+			printf("[audio] %s\n",msg);
+			break;
+	}
+}
+
+static unsigned int chip_log_seq(unsigned int pos)
+{
+	return chip_atomic_load(&chip_log_ring[pos % CHIP_LOG_SLOTS].seq) + (pos % CHIP_LOG_SLOTS);
+}
+
+static void chip_log_set_seq(unsigned int pos, unsigned int seq)
+{
+	chip_atomic_store(&chip_log_ring[pos % CHIP_LOG_SLOTS].seq, seq - (pos % CHIP_LOG_SLOTS));
+}
+
+// Queue a message. Safe from any thread, including the audio thread: it
+// only formats into the ring, and drops the message if the ring is full.
+void chip_log(unsigned int level, const char *fmt, ...)
+{
+	if (level > chip_log_level)
+	{
+		return;
+	}
+	chip_log_slot *slot;
+	unsigned int pos = __atomic_load_n(&chip_log_write, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		slot = &chip_log_ring[pos % CHIP_LOG_SLOTS];
+		int diff = (int)(chip_log_seq(pos) - pos);
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&chip_log_write, &pos, pos + 1, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			__atomic_add_fetch(&chip_log_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else
+		{
+			pos = __atomic_load_n(&chip_log_write, __ATOMIC_RELAXED);
+		}
+	}
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(slot->msg, CHIP_LOG_MSG_LEN, fmt, args);
+	va_end(args);
+	slot->level = level;
+	chip_log_set_seq(pos, pos + 1);
+}
+
+// Pass queued messages to the sink. Never called from the audio thread;
+// if another thread is already draining, leave it to that one.
+void chip_log_flush(void)
+{
+	if (__atomic_exchange_n(&chip_log_draining, 1, __ATOMIC_ACQUIRE))
+	{
+		return;
+	}
+	for (;;)
+	{
+		chip_log_slot *slot = &chip_log_ring[chip_log_read % CHIP_LOG_SLOTS];
+		if (chip_log_seq(chip_log_read) != chip_log_read + 1)
+		{
+			break;
+		}
+		if (chip_log_sink_ptr)
+		{
+			chip_log_sink_ptr(slot->level, slot->msg);
+		}
+		chip_log_set_seq(chip_log_read, chip_log_read + CHIP_LOG_SLOTS);
+		chip_log_read++;
+	}
+	unsigned int dropped = __atomic_exchange_n(&chip_log_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped && chip_log_sink_ptr)
+	{
+		char msg[CHIP_LOG_MSG_LEN];
+		snprintf(msg, sizeof(msg), "Log ring full, dropped %d messages.", dropped);
+		chip_log_sink_ptr(CHIP_LOG_WARN, msg);
+	}
+	__atomic_store_n(&chip_log_draining, 0, __ATOMIC_RELEASE);
+}
+
+size_t chip_log_footprint(void)
+{
+	return sizeof(chip_log_ring);
+}
+
+void chip_set_log_sink(chip_log_sink sink)
+{
+	chip_log_flush();
+	chip_log_sink_ptr = sink;
+}
+
+void chip_set_log_level(unsigned int level)
+{
+	chip_log_level = level;
+}
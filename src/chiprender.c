@@ -0,0 +1,93 @@
+#include "chipkernel.h"
+#include <string.h>
+
+ALLEGRO_THREAD *chip_render_thread;
+ALLEGRO_MUTEX *chip_ahead_mutex;
+ALLEGRO_COND *chip_ahead_cond;
+
+unsigned int chip_ahead_depth;
+int16_t *chip_ahead_ring;
+unsigned int chip_ahead_head;
+unsigned int chip_ahead_tail;
+unsigned int chip_ahead_misses;
+
+static int16_t *chip_ahead_slot(unsigned int idx)
+{
+	return chip_ahead_ring + ((idx % chip_ahead_depth) * chip_frag_size * 2);
+}
+
+// Render into every free slot of the ring. Only the render thread calls
+// this once audio is running; chip_start uses it to prime the ring.
+void chip_ahead_fill(void)
+{
+	while (chip_ahead_head - chip_atomic_load(&chip_ahead_tail) < chip_ahead_depth)
+	{
+		if (chip_atomic_load(&chip_config_pending))
+		{
+			chip_config_apply();
+		}
+		chip_render_fragment(chip_ahead_slot(chip_ahead_head));
+		chip_atomic_store(&chip_ahead_head, chip_ahead_head + 1);
+	}
+}
+
+// Hand the oldest pre-rendered fragment to the stream. Runs on the audio
+// thread; if the render thread has fallen behind, the fragment is silent.
+void chip_ahead_pop(int16_t *frame)
+{
+	if (chip_ahead_tail == chip_atomic_load(&chip_ahead_head))
+	{
+		memset(frame, 0, sizeof(int16_t) * 2 * chip_frag_size);
+		chip_ahead_misses++;
+		return;
+	}
+	memcpy(frame, chip_ahead_slot(chip_ahead_tail), sizeof(int16_t) * 2 * chip_frag_size);
+	chip_atomic_store(&chip_ahead_tail, chip_ahead_tail + 1);
+	al_signal_cond(chip_ahead_cond);
+}
+
+void *chip_render_func(ALLEGRO_THREAD *thr, void *arg)
+{
+	// Wake at least twice per fragment in case a signal is missed
+	double frag_time = (double)chip_frag_size / chip_rate;
+	chip_is_render_thread = 1;
+	chip_rt_enter(0);
+	al_lock_mutex(chip_ahead_mutex);
+	while (!al_get_thread_should_stop(thr))
+	{
+		chip_ahead_fill();
+		ALLEGRO_TIMEOUT timeout;
+		al_init_timeout(&timeout, frag_time / 2);
+		al_wait_cond_until(chip_ahead_cond, chip_ahead_mutex, &timeout);
+	}
+	al_unlock_mutex(chip_ahead_mutex);
+	return NULL;
+}
+
+void chip_ahead_destroy(void)
+{
+	if (chip_render_thread)
+	{
+		al_set_thread_should_stop(chip_render_thread);
+		al_broadcast_cond(chip_ahead_cond);
+		al_destroy_thread(chip_render_thread);
+		chip_render_thread = NULL;
+	}
+	if (chip_ahead_cond)
+	{
+		al_destroy_cond(chip_ahead_cond);
+		chip_ahead_cond = NULL;
+	}
+	if (chip_ahead_mutex)
+	{
+		al_destroy_mutex(chip_ahead_mutex);
+		chip_ahead_mutex = NULL;
+	}
+	chip_rt_unlock(chip_ahead_ring, chip_ahead_depth * chip_frag_size * 2 * sizeof(int16_t));
+	free(chip_ahead_ring);
+	chip_ahead_ring = NULL;
+	chip_ahead_depth = 0;
+	chip_ahead_head = 0;
+	chip_ahead_tail = 0;
+	chip_ahead_misses = 0;
+}
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include "chipkernel.h"
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define CHIP_RT_POSIX 1
+#endif
+
+unsigned int chip_rt_policy;
+int chip_rt_priority;
+uint64_t chip_rt_cpus;
+unsigned int chip_rt_lock_mem;
+unsigned int chip_rt_applied;
+
+// Rendering threads that have been through chip_rt_enter since chip_start,
+// and the settings that held on all of them. Guarded by chip_config_mutex.
+static unsigned int chip_rt_reports;
+static unsigned int chip_rt_result;
+static int chip_rt_locking; // Buffers are locked as they're allocated
+static int chip_rt_lock_failed; // Some buffer couldn't be locked
+
+// Stack the rendering threads touch up front so it's resident before the
+// first deadline
+#define CHIP_RT_STACK_PREFAULT (32 * 1024)
+
+static void chip_rt_prefault_stack(void)
+{
+	// Every store is through the volatile lvalue, so none can be dropped
+	volatile char stack[CHIP_RT_STACK_PREFAULT];
+	for (size_t i = 0; i < sizeof(stack); i += 64)
+	{
+		stack[i] = 0;
+	}
+}
+
+// Called from chip_start before any rendering thread runs
+void chip_rt_begin(void)
+{
+	al_lock_mutex(chip_config_mutex);
+	chip_rt_reports = 0;
+	chip_rt_result = 0;
+	if (chip_rt_policy != CHIP_RT_SCHED_OTHER)
+	{
+		chip_rt_result |= CHIP_RT_SCHED;
+	}
+	if (chip_rt_cpus)
+	{
+		chip_rt_result |= CHIP_RT_AFFINITY;
+	}
+	al_unlock_mutex(chip_config_mutex);
+	chip_atomic_store(&chip_rt_applied, 0);
+}
+
+// Called first thing on each rendering thread. With render-ahead on, the
+// audio thread runs one priority step above the render thread, so copying
+// a finished fragment out is never held up by rendering the next one.
+// Settings that don't take effect are dropped from the result, so it ends
+// up reporting only what holds on every rendering thread.
+void chip_rt_enter(int audio)
+{
+	unsigned int result = CHIP_RT_SCHED | CHIP_RT_AFFINITY;
+#ifdef CHIP_RT_POSIX
+	if (chip_rt_policy != CHIP_RT_SCHED_OTHER)
+	{
+		int policy = (chip_rt_policy == CHIP_RT_SCHED_RR) ? SCHED_RR : SCHED_FIFO;
+		int boost = chip_ahead_depth ? 1 : 0;
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = chip_rt_priority;
+		if (param.sched_priority < sched_get_priority_min(policy))
+		{
+			param.sched_priority = sched_get_priority_min(policy);
+		}
+		else if (param.sched_priority > sched_get_priority_max(policy) - boost)
+		{
+			param.sched_priority = sched_get_priority_max(policy) - boost;
+		}
+		if (audio)
+		{
+			param.sched_priority += boost;
+		}
+		int err = pthread_setschedparam(pthread_self(), policy, &param);
+		if (err)
+		{
+			chip_log_warn("Couldn't set real-time priority %d (error %d); using default scheduling.",param.sched_priority,err);
+			result &= ~CHIP_RT_SCHED;
+		}
+	}
+#ifdef __linux__
+	if (chip_rt_cpus)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (unsigned int i = 0; i < 64 && i < CPU_SETSIZE; i++)
+		{
+			if (chip_rt_cpus & ((uint64_t)1 << i))
+			{
+				CPU_SET(i, &set);
+			}
+		}
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err)
+		{
+			chip_log_warn("Couldn't pin rendering thread to CPU mask %llx (error %d).",(unsigned long long)chip_rt_cpus,err);
+			result &= ~CHIP_RT_AFFINITY;
+		}
+	}
+#else
+	result &= ~CHIP_RT_AFFINITY;
+#endif
+#else
+	result &= ~(CHIP_RT_SCHED | CHIP_RT_AFFINITY);
+#endif
+	if (chip_rt_lock_mem)
+	{
+		chip_rt_prefault_stack();
+	}
+	al_lock_mutex(chip_config_mutex);
+	chip_rt_result &= result;
+	chip_rt_reports++;
+	al_broadcast_cond(chip_config_cond);
+	al_unlock_mutex(chip_config_mutex);
+}
+
+// Wait for the given number of rendering threads to report from
+// chip_rt_enter, then publish what took effect on all of them. A thread
+// that hasn't reported within CHIP_CONFIG_TIMEOUT counts as having failed.
+void chip_rt_wait(unsigned int threads)
+{
+	ALLEGRO_TIMEOUT timeout;
+	al_init_timeout(&timeout, CHIP_CONFIG_TIMEOUT);
+	al_lock_mutex(chip_config_mutex);
+	while (chip_rt_reports < threads)
+	{
+		if (al_wait_cond_until(chip_config_cond, chip_config_mutex, &timeout))
+		{
+			break;
+		}
+	}
+	unsigned int result = chip_rt_result;
+	if (chip_rt_reports < threads)
+	{
+		chip_log_warn("Rendering threads didn't report their real-time setup in time.");
+		result = 0;
+	}
+	al_unlock_mutex(chip_config_mutex);
+	if (chip_rt_locking && !chip_rt_lock_failed)
+	{
+		result |= CHIP_RT_MLOCK;
+	}
+	chip_atomic_store(&chip_rt_applied, result);
+}
+
+// From chip_start until chip_shutdown, lock each buffer the renderer reads
+// as it's allocated, and unlock it as it's freed. The caller locks what
+// already exists right after this. The rest of the process is left alone.
+void chip_rt_lock_memory(void)
+{
+	chip_rt_lock_failed = 0;
+	chip_rt_locking = 1;
+}
+
+void chip_rt_unlock_memory(void)
+{
+	chip_rt_locking = 0;
+}
+
+// Keep a buffer resident, if memory locking is on
+void chip_rt_lock(const void *p, size_t len)
+{
+	if (!chip_rt_locking || !p || !len)
+	{
+		return;
+	}
+#ifdef CHIP_RT_POSIX
+	if (mlock(p, len) == 0)
+	{
+		return;
+	}
+#endif
+	if (!__atomic_exchange_n(&chip_rt_lock_failed, 1, __ATOMIC_RELAXED))
+	{
+		chip_log_warn("Couldn't lock render buffers in memory; check RLIMIT_MEMLOCK.");
+	}
+}
+
+// Unlock a buffer about to be freed. Locks don't nest, so only pages lying
+// wholly inside it are unlocked; a page it shares with other memory, ours
+// or the application's, stays as it was.
+void chip_rt_unlock(const void *p, size_t len)
+{
+	if (!chip_rt_locking || !p || !len)
+	{
+		return;
+	}
+#ifdef CHIP_RT_POSIX
+	uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t start = ((uintptr_t)p + page - 1) & ~(page - 1);
+	uintptr_t end = ((uintptr_t)p + len) & ~(page - 1);
+	if (end > start)
+	{
+		munlock((const void *)start, end - start);
+	}
+#endif
+}
@@ -0,0 +1,265 @@
+#include "chipkernel.h"
+
+ALLEGRO_THREAD *chip_sample_thread;
+ALLEGRO_MUTEX *chip_sample_mutex;
+ALLEGRO_COND *chip_sample_cond;
+
+// Fibonacci delta steps, indexed by DPCM nybble
+static const int chip_dpcm_delta[16] = {
+	-34, -21, -13, -8, -5, -3, -2, -1,
+	0, 1, 2, 3, 5, 8, 13, 21
+};
+
+// Pull the next raw byte of sample data. Runs on the audio thread, so
+// file-backed samples only ever read from the ring, never the file.
+static int chip_sample_fetch(chip_sample *s, uint8_t *out)
+{
+	if (s->mem)
+	{
+		if (s->mem_pos >= s->mem_len)
+		{
+			if (!s->loop_en)
+			{
+				s->done = 1;
+				return 0;
+			}
+			s->mem_pos = 0;
+		}
+		*out = s->mem[s->mem_pos++];
+		return 1;
+	}
+
+	unsigned int head = chip_atomic_load(&s->head);
+	while (s->tail != head)
+	{
+		unsigned int c = s->tail % CHIP_SAMPLE_CHUNKS;
+		if (s->read_pos < s->chunk_len[c])
+		{
+			*out = s->ring[(c * CHIP_SAMPLE_CHUNK_SIZE) + s->read_pos];
+			s->read_pos++;
+			return 1;
+		}
+		// Chunk used up, hand it back to the sample thread
+		s->read_pos = 0;
+		chip_atomic_store(&s->tail, s->tail + 1);
+	}
+
+	if (chip_atomic_load(&s->eof) && s->tail == chip_atomic_load(&s->head))
+	{
+		s->done = 1;
+	}
+	else
+	{
+		s->underruns++;
+	}
+	return 0;
+}
+
+static void chip_sample_decode(chip_sample *s, chip_channel_state *st)
+{
+	uint8_t b;
+	if (s->done)
+	{
+		st->sample_level = 0;
+		return;
+	}
+	switch (s->format)
+	{
+		case CHIP_SAMPLE_DPCM4:
+			if (!s->nybble_hi)
+			{
+				if (!chip_sample_fetch(s, &s->dpcm_byte))
+				{
+					break;
+				}
+				s->dpcm_acc += chip_dpcm_delta[s->dpcm_byte & 0xF];
+			}
+			else
+			{
+				s->dpcm_acc += chip_dpcm_delta[s->dpcm_byte >> 4];
+			}
+			s->nybble_hi = !s->nybble_hi;
+			if (s->dpcm_acc > 127)
+			{
+				s->dpcm_acc = 127;
+			}
+			else if (s->dpcm_acc < -128)
+			{
+				s->dpcm_acc = -128;
+			}
+			st->sample_level = s->dpcm_acc * 256;
+			break;
+
+		case CHIP_SAMPLE_PCM8:
+			if (chip_sample_fetch(s, &b))
+			{
+				st->sample_level = ((int)b - 128) * 256;
+			}
+			break;
+
+		case CHIP_SAMPLE_PCM16:
+			// Hold on to the low byte if the ring runs dry between halves
+			if (!s->nybble_hi)
+			{
+				if (!chip_sample_fetch(s, &s->dpcm_byte))
+				{
+					break;
+				}
+				s->nybble_hi = 1;
+			}
+			if (chip_sample_fetch(s, &b))
+			{
+				st->sample_level = (int16_t)(s->dpcm_byte | (b << 8));
+				s->nybble_hi = 0;
+			}
+			break;
+	}
+	if (s->done)
+	{
+		st->sample_level = 0;
+	}
+}
+
+// Sample channel equivalent of chip_channel_prog
+void chip_sample_prog(chip_channel *ch, chip_channel_state *st, chip_sample *s)
+{
+	if (!s->started)
+	{
+		// A new sample starts right away, from silence
+		s->started = 1;
+		st->counter = 0;
+		st->sample_level = 0;
+	}
+	if (st->counter == 0)
+	{
+		st->counter = ch->period - 1;
+		chip_sample_decode(s, st);
+	}
+	else
+	{
+		st->counter--;
+	}
+}
+
+// Top up a file-backed sample's ring. Never called from the audio thread.
+void chip_sample_fill(chip_sample *s)
+{
+	if (!s->file)
+	{
+		return;
+	}
+	while (!s->eof && s->head - chip_atomic_load(&s->tail) < CHIP_SAMPLE_CHUNKS)
+	{
+		unsigned int c = s->head % CHIP_SAMPLE_CHUNKS;
+		uint8_t *dest = &s->ring[c * CHIP_SAMPLE_CHUNK_SIZE];
+		size_t got = fread(dest, 1, CHIP_SAMPLE_CHUNK_SIZE, s->file);
+		while (got < CHIP_SAMPLE_CHUNK_SIZE && s->loop_en)
+		{
+			// Wrap around to the start of the sample data
+			if (fseek(s->file, s->offset, SEEK_SET) != 0)
+			{
+				break;
+			}
+			size_t more = fread(dest + got, 1, CHIP_SAMPLE_CHUNK_SIZE - got, s->file);
+			if (!more)
+			{
+				break;
+			}
+			got += more;
+		}
+		if (got)
+		{
+			s->chunk_len[c] = got;
+			chip_atomic_store(&s->head, s->head + 1);
+		}
+		if (got < CHIP_SAMPLE_CHUNK_SIZE)
+		{
+			chip_atomic_store(&s->eof, 1);
+		}
+	}
+}
+
+// Only once no thread can reach the sample: once retired and reaped, or
+// for samples that were never attached
+void chip_sample_destroy(chip_sample *s)
+{
+	if (!s)
+	{
+		return;
+	}
+	if (s->file)
+	{
+		fclose(s->file);
+	}
+	chip_rt_unlock(s->ring, CHIP_SAMPLE_CHUNKS * CHIP_SAMPLE_CHUNK_SIZE);
+	free(s->ring);
+	chip_rt_unlock(s, sizeof(chip_sample));
+	free(s);
+}
+
+// Bytes a sample has allocated, read-ahead ring included
+size_t chip_sample_size(const chip_sample *s)
+{
+	return sizeof(chip_sample) + (s->ring ? CHIP_SAMPLE_CHUNKS * CHIP_SAMPLE_CHUNK_SIZE : 0);
+}
+
+void *chip_sample_func(ALLEGRO_THREAD *thr, void *arg)
+{
+	chip_sample **snap = NULL;
+	unsigned int snap_max = 0;
+	al_lock_mutex(chip_sample_mutex);
+	while (!al_get_thread_should_stop(thr))
+	{
+		// Only the list of file-backed samples is taken under the lock;
+		// reads from disk happen outside it. The lock also keeps
+		// chip_resize_channels from freeing an array mid-snapshot.
+		unsigned int snap_len = 0;
+		unsigned int seq = chip_atomic_load(&chip_channel_seq);
+		if (!(seq & 1))
+		{
+			chip_channel *channels = __atomic_load_n(&chip_channels, __ATOMIC_RELAXED);
+			unsigned int num_channels = __atomic_load_n(&chip_num_channels, __ATOMIC_RELAXED);
+			if (snap_max < num_channels)
+			{
+				chip_sample **grown = (chip_sample **)realloc(snap, num_channels * sizeof(chip_sample *));
+				if (grown)
+				{
+					snap = grown;
+					snap_max = num_channels;
+				}
+			}
+			for (unsigned int i = 0; i < num_channels && i < snap_max; i++)
+			{
+				chip_sample *s = chip_atomic_load(&channels[i].sample);
+				if (s && s->file)
+				{
+					snap[snap_len++] = s;
+				}
+			}
+			// Channels moved underneath us; catch them next pass
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&chip_channel_seq, __ATOMIC_RELAXED) != seq)
+			{
+				snap_len = 0;
+			}
+		}
+		al_unlock_mutex(chip_sample_mutex);
+
+		for (unsigned int i = 0; i < snap_len; i++)
+		{
+			chip_sample_fill(snap[i]);
+		}
+		// Anything retired from here on was not in this snapshot
+		chip_retired_reap(0);
+		// This thread also hands queued log messages to the sink
+		chip_log_flush();
+
+		al_lock_mutex(chip_sample_mutex);
+		ALLEGRO_TIMEOUT timeout;
+		al_init_timeout(&timeout, CHIP_SAMPLE_POLL);
+		al_wait_cond_until(chip_sample_cond, chip_sample_mutex, &timeout);
+	}
+	al_unlock_mutex(chip_sample_mutex);
+	free(snap);
+	return NULL;
+}
@@ -0,0 +1,160 @@
+#include "chipkernel.h"
+
+// Queued batch records. The control thread fills slots past chip_update_head
+// and then publishes a whole batch by moving head once; the renderer applies
+// everything up to head before the next sample.
+static chip_update chip_update_ring[CHIP_UPDATE_SLOTS];
+unsigned int chip_update_head;
+unsigned int chip_update_tail;
+__thread int chip_in_engine;
+
+static void chip_update_one(const chip_update *u)
+{
+	if (u->channel >= chip_num_channels)
+	{
+		// Channels went away since the batch was queued
+		return;
+	}
+	chip_channel *ch = &chip_channels[u->channel];
+	if ((u->mask & CHIP_UPDATE_WAVE) && !chip_wave_swap(ch, u->wave_data, u->wave_len, NULL))
+	{
+		// The control thread always leaves the renderer a descriptor
+		chip_log_error("No free wave descriptor on channel %d",u->channel);
+	}
+	if (u->mask & CHIP_UPDATE_PERIOD)
+	{
+		ch->period = u->period;
+	}
+	if (u->mask & CHIP_UPDATE_AMP)
+	{
+		ch->amplitude[0] = u->amplitude[0];
+		ch->amplitude[1] = u->amplitude[1];
+	}
+	if (u->mask & CHIP_UPDATE_NOISE)
+	{
+		ch->noise_en = u->noise_en;
+	}
+	if (u->mask & CHIP_UPDATE_LOOP)
+	{
+		ch->loop_en = u->loop_en;
+	}
+	if (u->mask & CHIP_UPDATE_WAVE_POS)
+	{
+		chip_channel_states[u->channel].wave_pos = u->wave_pos;
+	}
+	if (u->mask & CHIP_UPDATE_NOISE_TAP)
+	{
+		ch->noise_tap = u->noise_tap;
+	}
+}
+
+// Apply every published batch. Runs on the rendering thread.
+void chip_update_apply(void)
+{
+	unsigned int head = chip_atomic_load(&chip_update_head);
+	// Slots are handed back all at once, after the last one is read
+	for (unsigned int tail = chip_update_tail; tail != head; tail++)
+	{
+		chip_update_one(&chip_update_ring[tail % CHIP_UPDATE_SLOTS]);
+	}
+	chip_atomic_store(&chip_update_tail, head);
+}
+
+size_t chip_update_footprint(void)
+{
+	return sizeof(chip_update_ring);
+}
+
+// Drop records that were never applied. Only safe once nothing is
+// rendering.
+void chip_update_reset(void)
+{
+	chip_update_head = 0;
+	chip_update_tail = 0;
+}
+
+// Check a whole batch before any of it is queued, so a bad record can't
+// leave a chord half-changed
+static int chip_update_validate(const chip_update *updates, unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		const chip_update *u = &updates[i];
+		if (u->channel >= chip_num_channels)
+		{
+			chip_log_error("Channel out of range (%d > %d)",u->channel,chip_num_channels);
+			return 0;
+		}
+		if ((u->mask & CHIP_UPDATE_WAVE) && (!u->wave_data || !u->wave_len))
+		{
+			chip_log_error("Empty wave in update for channel %d",u->channel);
+			return 0;
+		}
+		if ((u->mask & CHIP_UPDATE_PERIOD) && (u->mask & CHIP_UPDATE_FREQ))
+		{
+			chip_log_error("Update for channel %d sets both period and frequency",u->channel);
+			return 0;
+		}
+		if ((u->mask & CHIP_UPDATE_FREQ) && !(u->freq > 0.0f))
+		{
+			chip_log_error("Invalid frequency in update for channel %d",u->channel);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Queue a batch of channel changes that the renderer applies together,
+// between two samples. Batches must all come from one thread: either a
+// single control thread, or the engine callback, where they take effect
+// immediately. Returns 0 without changing anything if a record is invalid
+// or the queue is full.
+int chip_update_channels(const chip_update *updates, unsigned int count)
+{
+	if (!count)
+	{
+		return 1;
+	}
+	if (!chip_update_validate(updates, count))
+	{
+		return 0;
+	}
+	if (count > CHIP_UPDATE_SLOTS - (chip_update_head - chip_atomic_load(&chip_update_tail)))
+	{
+		chip_log_warn("Update queue full, dropped a batch of %d.",count);
+		return 0;
+	}
+
+	unsigned int head = chip_update_head;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		chip_update *u = &chip_update_ring[(head + i) % CHIP_UPDATE_SLOTS];
+		*u = updates[i];
+		if (u->mask & CHIP_UPDATE_FREQ)
+		{
+			// Same conversion as chip_set_freq, done here once per record
+			unsigned int len = (u->mask & CHIP_UPDATE_WAVE) ? u->wave_len :
+				__atomic_load_n(&chip_channels[u->channel].wave, __ATOMIC_ACQUIRE)->len;
+			u->period = chip_freq_period(len, u->freq);
+			u->mask |= CHIP_UPDATE_PERIOD;
+		}
+		if ((u->mask & CHIP_UPDATE_PERIOD) && u->period < 1)
+		{
+			u->period = 1;
+		}
+		if ((u->mask & CHIP_UPDATE_NOISE_TAP) && u->noise_tap > 15)
+		{
+			u->noise_tap = 0;
+		}
+	}
+	chip_atomic_store(&chip_update_head, head + count);
+
+	// Inside the engine callback the renderer is paused on this thread.
+	// The flag is per thread, so a control thread calling in while the
+	// callback runs still leaves the batch to the renderer.
+	if (chip_in_engine)
+	{
+		chip_update_apply();
+	}
+	return 1;
+}
@@ -0,0 +1,279 @@
+#include "chipkernel.h"
+
+// Swapped-out wave buffers and samples, newest first
+static chip_retired *chip_retired_list;
+
+// Bytes waiting on the list, for chip_get_memory_footprint
+size_t chip_retired_bytes;
+
+// Control-side readers between chip_sample_peek and chip_sample_unpeek
+static unsigned int chip_sample_readers;
+
+// A wave descriptor's state word: CHIP_WAVE_* below, retire epoch above.
+// Keeping both in one word lets a claim be a single compare-and-swap.
+#define CHIP_WAVE_STATE(word) ((word) & 3)
+#define CHIP_WAVE_WORD(epoch, state) (((epoch) << 2) | (state))
+
+// Whether the renderer has started a sample since the descriptor retired
+static int chip_wave_passed(unsigned int word, unsigned int epoch)
+{
+	return (int)((epoch << 2) - (word & ~3u)) > 0;
+}
+
+static size_t chip_wave_buf_size(unsigned int len)
+{
+	return sizeof(chip_wave_buf) + len * sizeof(uint16_t);
+}
+
+chip_wave_buf *chip_wave_buf_create(unsigned int len)
+{
+	chip_wave_buf *b = (chip_wave_buf *)calloc(1, chip_wave_buf_size(len));
+	if (b)
+	{
+		b->len = len;
+		chip_rt_lock(b, chip_wave_buf_size(len));
+	}
+	return b;
+}
+
+static void chip_wave_buf_destroy(chip_wave_buf *b)
+{
+	if (b)
+	{
+		chip_rt_unlock(b, chip_wave_buf_size(b->len));
+		free(b);
+	}
+}
+
+// Give a channel its descriptors, playing a one-step silent wave. Only
+// for channels the renderer can't see yet. Returns 0 if out of memory.
+int chip_wave_pool_create(chip_channel *ch)
+{
+	chip_wave_buf *b = chip_wave_buf_create(1);
+	ch->waves = (chip_wave *)calloc(CHIP_WAVE_SLOTS, sizeof(chip_wave));
+	if (!b || !ch->waves)
+	{
+		chip_wave_buf_destroy(b);
+		free(ch->waves);
+		ch->waves = NULL;
+		return 0;
+	}
+	chip_rt_lock(ch->waves, CHIP_WAVE_SLOTS * sizeof(chip_wave));
+	chip_wave *w = &ch->waves[0];
+	w->state = CHIP_WAVE_LIVE;
+	w->data = b->data;
+	w->len = 1;
+	w->buf = b;
+	ch->wave = w;
+	return 1;
+}
+
+// Lock the descriptors and owned buffer of a channel made before
+// chip_start turned memory locking on
+void chip_wave_pool_lock(chip_channel *ch)
+{
+	chip_rt_lock(ch->waves, CHIP_WAVE_SLOTS * sizeof(chip_wave));
+	if (ch->wave && ch->wave->buf)
+	{
+		chip_rt_lock(ch->wave->buf, chip_wave_buf_size(ch->wave->len));
+	}
+}
+
+// Free a channel's descriptors and the buffer it plays, once the renderer
+// can no longer reach the channel. Retired buffers are already on the list.
+void chip_wave_pool_destroy(chip_channel *ch)
+{
+	if (ch->wave)
+	{
+		chip_wave_buf_destroy(ch->wave->buf);
+	}
+	chip_rt_unlock(ch->waves, CHIP_WAVE_SLOTS * sizeof(chip_wave));
+	free(ch->waves);
+	ch->waves = NULL;
+	ch->wave = NULL;
+}
+
+size_t chip_wave_pool_footprint(chip_channel *ch)
+{
+	size_t total = CHIP_WAVE_SLOTS * sizeof(chip_wave);
+	const chip_wave *w = __atomic_load_n(&ch->wave, __ATOMIC_ACQUIRE);
+	if (w && w->buf)
+	{
+		total += chip_wave_buf_size(w->len);
+	}
+	return total;
+}
+
+// Take a descriptor no renderer can be reading. The render thread has
+// one kept back for it: the control thread won't take the last free
+// descriptor, and whatever the render thread itself retires is free again
+// right away. Returns NULL if none is free.
+static chip_wave *chip_wave_claim(chip_channel *ch)
+{
+	unsigned int epoch = __atomic_load_n(&chip_render_epoch, __ATOMIC_SEQ_CST);
+	unsigned int words[CHIP_WAVE_SLOTS];
+	unsigned int free_slots = 0;
+	for (unsigned int i = 0; i < CHIP_WAVE_SLOTS; i++)
+	{
+		words[i] = __atomic_load_n(&ch->waves[i].state, __ATOMIC_ACQUIRE);
+		unsigned int state = CHIP_WAVE_STATE(words[i]);
+		if (state == CHIP_WAVE_FREE || (state == CHIP_WAVE_RETIRED && chip_wave_passed(words[i], epoch)))
+		{
+			free_slots++;
+		}
+		else
+		{
+			words[i] = CHIP_WAVE_LIVE;
+		}
+	}
+	if (!free_slots || (free_slots < 2 && !chip_is_render_thread && chip_is_started))
+	{
+		return NULL;
+	}
+	for (unsigned int i = 0; i < CHIP_WAVE_SLOTS; i++)
+	{
+		// A descriptor can only come back to the same word with a later
+		// epoch, so an unchanged word is still free
+		if (words[i] != CHIP_WAVE_LIVE &&
+			__atomic_compare_exchange_n(&ch->waves[i].state, &words[i], CHIP_WAVE_LIVE, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			return &ch->waves[i];
+		}
+	}
+	return NULL;
+}
+
+// Hand a swapped-out descriptor back to its channel's pool
+static void chip_wave_release(chip_wave *w)
+{
+	if (w->buf)
+	{
+		chip_retire(&w->buf->retired, CHIP_RETIRED_WAVE, chip_wave_buf_size(w->len));
+		w->buf = NULL;
+	}
+	unsigned int word = CHIP_WAVE_FREE;
+	if (chip_is_started)
+	{
+		// The render thread has already moved past what it swapped out.
+		// Anyone else has to wait for the renderer's next sample.
+		unsigned int epoch = __atomic_load_n(&chip_render_epoch, __ATOMIC_SEQ_CST);
+		word = CHIP_WAVE_WORD(chip_is_render_thread ? epoch - 1 : epoch, CHIP_WAVE_RETIRED);
+	}
+	__atomic_store_n(&w->state, word, __ATOMIC_RELEASE);
+}
+
+// Swap a channel's wave without allocating. Library-owned data comes in
+// as buf, which belongs to the channel from here on, or is freed if the
+// swap fails. Off the render thread this waits for the renderer if a
+// caller swaps faster than it renders. Returns 0 if no descriptor freed up.
+int chip_wave_swap(chip_channel *ch, uint16_t *data, unsigned int len, chip_wave_buf *buf)
+{
+	chip_wave *w = chip_wave_claim(ch);
+	if (!w && !chip_is_render_thread)
+	{
+		double deadline = al_get_time() + CHIP_CONFIG_TIMEOUT;
+		while (!w && al_get_time() < deadline)
+		{
+			al_rest(CHIP_SAMPLE_POLL / 10);
+			w = chip_wave_claim(ch);
+		}
+	}
+	if (!w)
+	{
+		chip_wave_buf_destroy(buf);
+		return 0;
+	}
+	w->data = data;
+	w->len = len;
+	w->buf = buf;
+	// The renderer sees the old wave or the new one, never half of each
+	chip_wave_release(__atomic_exchange_n(&ch->wave, w, __ATOMIC_ACQ_REL));
+	return 1;
+}
+
+static void chip_retired_destroy(chip_retired *r)
+{
+	if (r->kind == CHIP_RETIRED_WAVE)
+	{
+		chip_wave_buf_destroy((chip_wave_buf *)r);
+	}
+	else
+	{
+		chip_sample_destroy((chip_sample *)r);
+	}
+}
+
+static void chip_retired_push(chip_retired *r)
+{
+	chip_retired *head = __atomic_load_n(&chip_retired_list, __ATOMIC_RELAXED);
+	do
+	{
+		r->next = head;
+	} while (!__atomic_compare_exchange_n(&chip_retired_list, &head, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Called right after r was swapped out of its channel. Never blocks or
+// frees while rendering runs, so it's safe from the engine callback.
+void chip_retire(chip_retired *r, unsigned int kind, size_t size)
+{
+	r->kind = kind;
+	r->size = size;
+	if (!chip_is_started)
+	{
+		// Nothing renders concurrently; an engine callback in chip_render
+		// runs before any channel is read
+		chip_retired_destroy(r);
+		return;
+	}
+	// Ordered after the swap. A renderer that still read the old pointer
+	// did so in a sample started no later than this epoch.
+	r->epoch = __atomic_load_n(&chip_render_epoch, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&chip_retired_bytes, size, __ATOMIC_RELAXED);
+	chip_retired_push(r);
+}
+
+void chip_sample_retire(chip_sample *s)
+{
+	if (s)
+	{
+		chip_retire(&s->retired, CHIP_RETIRED_SAMPLE, chip_sample_size(s));
+	}
+}
+
+// Read a channel's sample from the control side. Until the matching
+// chip_sample_unpeek, no sample swapped out in the meantime is freed.
+chip_sample *chip_sample_peek(chip_channel *ch)
+{
+	__atomic_add_fetch(&chip_sample_readers, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&ch->sample, __ATOMIC_SEQ_CST);
+}
+
+void chip_sample_unpeek(void)
+{
+	__atomic_sub_fetch(&chip_sample_readers, 1, __ATOMIC_SEQ_CST);
+}
+
+// Free everything the renderer has moved past, or with all set, everything
+// (only once nothing renders). Runs on the sample thread, or once it's gone.
+void chip_retired_reap(int all)
+{
+	chip_retired *r = __atomic_exchange_n(&chip_retired_list, NULL, __ATOMIC_ACQUIRE);
+	unsigned int epoch = __atomic_load_n(&chip_render_epoch, __ATOMIC_SEQ_CST);
+	// Samples were swapped out before they got here, so a reader that
+	// starts after this check can only find the new ones
+	int peeked = __atomic_load_n(&chip_sample_readers, __ATOMIC_SEQ_CST) != 0;
+	while (r)
+	{
+		chip_retired *next = r->next;
+		if (all || ((int)(epoch - r->epoch) > 0 && !(peeked && r->kind == CHIP_RETIRED_SAMPLE)))
+		{
+			__atomic_sub_fetch(&chip_retired_bytes, r->size, __ATOMIC_RELAXED);
+			chip_retired_destroy(r);
+		}
+		else
+		{
+			chip_retired_push(r);
+		}
+		r = next;
+	}
+}
@@ -1,27 +1,112 @@
 #include "libchip.h"
 #include "chipkernel.h"
 
+static size_t chip_align_up(size_t n)
+{
+	return (n + CHIP_CACHE_LINE - 1) & ~(size_t)(CHIP_CACHE_LINE - 1);
+}
+
+// Bytes needed for num_channels worth of channel memory, alignment slack
+// included
+static size_t chip_channel_block_size(unsigned int num_channels)
+{
+	return chip_align_up(num_channels * sizeof(chip_channel_state)) +
+		chip_align_up(num_channels * sizeof(chip_channel)) + CHIP_CACHE_LINE;
+}
+
+// Carve the render-owned states and the control-side settings out of one
+// zeroed allocation, each array starting on its own cache line. Returns
+// the block to free, or NULL.
+static void *chip_channel_alloc(unsigned int num_channels, chip_channel **channels, chip_channel_state **states)
+{
+	void *block = calloc(1, chip_channel_block_size(num_channels));
+	if (!block)
+	{
+		return NULL;
+	}
+	chip_rt_lock(block, chip_channel_block_size(num_channels));
+	uintptr_t base = (uintptr_t)chip_align_up((uintptr_t)block);
+	*states = (chip_channel_state *)base;
+	*channels = (chip_channel *)(base + chip_align_up(num_channels * sizeof(chip_channel_state)));
+	return block;
+}
+
+static void chip_channel_free(void *block, unsigned int num_channels)
+{
+	chip_rt_unlock(block, chip_channel_block_size(num_channels));
+	free(block);
+}
+
+// Lock everything the renderer reads that was allocated before chip_start
+// turned memory locking on
+static void chip_lock_buffers(void)
+{
+	chip_rt_lock(chip_channel_block, chip_channel_block_size(chip_num_channels));
+	for (unsigned int i = 0; i < chip_num_channels; i++)
+	{
+		chip_channel *ch = &chip_channels[i];
+		chip_wave_pool_lock(ch);
+		if (ch->sample)
+		{
+			chip_rt_lock(ch->sample, sizeof(chip_sample));
+			chip_rt_lock(ch->sample->ring, CHIP_SAMPLE_CHUNKS * CHIP_SAMPLE_CHUNK_SIZE);
+		}
+	}
+	chip_rt_lock(chip_ahead_ring, chip_ahead_depth * chip_frag_size * 2 * sizeof(int16_t));
+}
+
+// Power-on state for a channel. Returns 0 if out of memory.
+static int chip_channel_defaults(chip_channel *ch, chip_channel_state *st)
+{
+	ch->period = 1;
+	ch->noise_tap = 7;
+	st->noise_state = 0x0001;
+	return chip_wave_pool_create(ch);
+}
+
+// Free whatever a channel owns, once the renderer can't reach it
+static void chip_channel_release(chip_channel *ch)
+{
+	chip_wave_pool_destroy(ch);
+	chip_sample_retire(ch->sample);
+}
+
 // User functions
 void chip_shutdown(void)
 {	
-	chip_num_channels = 0;
+	unsigned int num_channels = chip_num_channels;
 	chip_is_init = 0;
+	chip_is_offline = 0;
 	if (chip_thread)
 	{
 		al_set_thread_should_stop(chip_thread);
 		al_destroy_thread(chip_thread);
 		chip_thread = NULL;
 	}
+	chip_ahead_destroy();
+	chip_update_reset();
+	chip_rt_policy = CHIP_RT_SCHED_OTHER;
+	chip_rt_cpus = 0;
+	chip_rt_lock_mem = 0;
+	chip_rt_applied = 0;
+	chip_adapt_min = 0;
+	chip_adapt_max = 0;
+	if (chip_sample_thread)
+	{
+		al_set_thread_should_stop(chip_sample_thread);
+		al_broadcast_cond(chip_sample_cond);
+		al_destroy_thread(chip_sample_thread);
+		chip_sample_thread = NULL;
+	}
+	// Nothing renders or reads ahead any more
+	chip_num_channels = 0;
+	chip_is_started = 0;
+	chip_stream_destroy();
 	if (chip_queue)
 	{
 		al_destroy_event_queue(chip_queue);
 		chip_queue = NULL;
 	}
-	if (chip_stream)
-	{
-		al_destroy_audio_stream(chip_stream);
-		chip_stream = NULL;
-	}
 	if (chip_voice)
 	{
 		al_destroy_voice(chip_voice);
@@ -34,20 +119,40 @@ void chip_shutdown(void)
 	}
 	if (chip_channels)
 	{
-		for (unsigned int i = 0; i < chip_num_channels; i++)
+		for (unsigned int i = 0; i < num_channels; i++)
 		{
-			chip_channel *ch = &chip_channels[i];
-			al_unlock_mutex(ch->mutex);
-			// Release waves if the channel owns it
-			if (ch->own_wave)
-			{
-				free(ch->wave_data);
-				al_destroy_mutex(ch->mutex);
-			}
+			chip_channel_release(&chip_channels[i]);
 		}
-		free(chip_channels);
+		chip_channel_free(chip_channel_block, num_channels);
+		chip_channel_block = NULL;
 		chip_channels = NULL;
+		chip_channel_states = NULL;
+	}
+	// The sample thread is gone; free what it didn't get to
+	chip_retired_reap(1);
+	chip_rt_unlock_memory();
+	if (chip_sample_cond)
+	{
+		al_destroy_cond(chip_sample_cond);
+		chip_sample_cond = NULL;
+	}
+	if (chip_sample_mutex)
+	{
+		al_destroy_mutex(chip_sample_mutex);
+		chip_sample_mutex = NULL;
+	}
+	if (chip_config_cond)
+	{
+		al_destroy_cond(chip_config_cond);
+		chip_config_cond = NULL;
+	}
+	if (chip_config_mutex)
+	{
+		al_destroy_mutex(chip_config_mutex);
+		chip_config_mutex = NULL;
 	}
+	chip_config_pending = 0;
+	chip_log_flush();
 }
 
 static int chip_allegro_setup(void)
@@ -56,31 +161,31 @@ static int chip_allegro_setup(void)
 	{
 		if (!al_init())
 		{
-			fprintf(stderr,"[audio] Error: Could not initialize Allegro.\n");
+			chip_log_error("Could not initialize Allegro.");
 			return 0;
 		}
 	}
-	printf("[audio] Allegro is installed\n");
+	chip_log_info("Allegro is installed");
 	if (!al_is_audio_installed())
 	{
 	
 		if (!al_install_audio())
 		{
-			fprintf(stderr,"[audio] Error: Could not install audio addon.\n");
+			chip_log_error("Could not install audio addon.");
 			return 0;
 		}
 	}
-	printf("[audio] Audio addon is installed\n");
+	chip_log_info("Audio addon is installed");
 	// Voice
 	chip_voice = al_create_voice(chip_rate,
 		CHIP_DEPTH,
 		CHIP_CHAN);
 	if (!chip_voice)
 	{
-		fprintf(stderr,"[audio] Error: Failed to create voice.\n");
+		chip_log_error("Failed to create voice.");
 		return 0;
 	}
-	printf("[audio] Created voice at %X\n",(unsigned int)chip_voice);
+	chip_log_info("Created voice at %p",(void *)chip_voice);
 
 	// Mixer
 	chip_mixer = al_create_mixer(chip_rate,
@@ -88,104 +193,181 @@ static int chip_allegro_setup(void)
 		CHIP_CHAN);
 	if (!chip_mixer)
 	{
-		fprintf(stderr,"[audio] Error: Failed to create mixer.\n");
+		chip_log_error("Failed to create mixer.");
 		return 0;
 	}
-	printf("[audio] Created mixer at %X\n",(unsigned int)chip_mixer);
+	chip_log_info("Created mixer at %p",(void *)chip_mixer);
 
 	if (!al_attach_mixer_to_voice(chip_mixer, chip_voice))
 	{
-		fprintf(stderr,"[audio] Error: Failed to attach mixer to voice.\n");
+		chip_log_error("Failed to attach mixer to voice.");
 		return 0;
 	}
-	printf("[audio] Attached mixer to voice\n");
+	chip_log_info("Attached mixer to voice");
 
 	al_set_default_mixer(chip_mixer);
 	al_reserve_samples(chip_frag_num);
 
-	// Build stream
+	// Set up event source for the audio thread
+	chip_queue = al_create_event_queue();
+	chip_log_info("Created queue at %p",(void *)chip_queue);
+
+	return chip_stream_setup();
+
+}
+
+// Build the stream at the current fragment size and hook it up to the
+// mixer and the audio thread's event queue
+int chip_stream_setup(void)
+{
 	chip_stream = al_create_audio_stream(
 		chip_frag_num,
 		chip_frag_size,
 		chip_rate,
 		CHIP_DEPTH,
 		CHIP_CHAN);
-	printf("[audio] Created stream at %X\n",(unsigned int)chip_stream);
+	if (!chip_stream)
+	{
+		chip_log_error("Failed to create stream.");
+		return 0;
+	}
+	chip_log_info("Created stream at %p",(void *)chip_stream);
 	if (!al_attach_audio_stream_to_mixer(chip_stream, al_get_default_mixer()))
 	{
-		printf("[audio] Error: Couldn't attach stream to mixer.\n");
+		chip_log_error("Couldn't attach stream to mixer.");
 		return 0;
 	}
-	printf("[audio] Attached stream to mixer.\n");
+	chip_log_info("Attached stream to mixer.");
 
-	// Set up event source for the audio thread
-	chip_queue = al_create_event_queue();
-	printf("[audio] Created queue at %X\n",(unsigned int)chip_queue);
 	al_register_event_source(chip_queue, 
 		al_get_audio_stream_event_source(chip_stream));
-	printf("[audio] Registered audio event source with queue.\n");
+	chip_log_info("Registered audio event source with queue.");
 
 	return 1;
+}
 
+void chip_stream_destroy(void)
+{
+	if (chip_stream)
+	{
+		if (chip_queue)
+		{
+			al_unregister_event_source(chip_queue,
+				al_get_audio_stream_event_source(chip_stream));
+		}
+		al_destroy_audio_stream(chip_stream);
+		chip_stream = NULL;
+	}
 }
 
 static int chip_arg_sanity(void)
 {
 	if (!chip_rate)
 	{
-		fprintf(stderr,"[audio] Error: Invalid sample rate specified.\n");
+		chip_log_error("Invalid sample rate specified.");
 		return 0;
 	}
-	printf("[audio] Sampling rate: %dHz\n",chip_rate);
+	chip_log_info("Sampling rate: %dHz",chip_rate);
 	if (!chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: At least one channel must be created.\n");
+		chip_log_error("At least one channel must be created.");
 		return 0;
 	}
-	printf("[audio] Using %d channels\n",chip_num_channels);
+	chip_log_info("Using %d channels",chip_num_channels);
 	if (!chip_frag_size)
 	{
-		fprintf(stderr,"[audio] Warning: No fragment size given. Defaulting to 1024.\n");
+		chip_log_warn("No fragment size given. Defaulting to 1024.");
 		chip_frag_size = CHIP_SIZE_FRAGMENT;
 	}
-	printf("[audio] Using %d for fragment size\n",chip_frag_size);
+	chip_log_info("Using %d for fragment size",chip_frag_size);
 	if (!chip_frag_num)
 	{
-		fprintf(stderr,"[audio] Warning: No fragment number given. Defaulting to 4.\n");
+		chip_log_warn("No fragment number given. Defaulting to 4.");
 		chip_frag_num = CHIP_NUM_FRAGMENTS;
 	}
-	printf("[audio] Using %d fragments\n",chip_frag_num);
+	chip_log_info("Using %d fragments",chip_frag_num);
 	if (!chip_rate_mul)
 	{
 		chip_rate_mul = 1;
 	}
-	printf("[audio] Rate multiplier is %d\n",chip_rate_mul);
+	chip_log_info("Rate multiplier is %d",chip_rate_mul);
 	return 1;
 }
 
 static int chip_channel_init(void)
 {
 	// Set up channel state
-	chip_channels = (chip_channel *)calloc(chip_num_channels,sizeof(chip_channel));
-	if (!chip_channels)
+	chip_channel_block = chip_channel_alloc(chip_num_channels, &chip_channels, &chip_channel_states);
+	if (!chip_channel_block)
 	{
-		fprintf(stderr,"[audio] Couldn't malloc for channel states. Maybe too many have been requested?\n");
+		chip_log_error("Couldn't malloc for channel states. Maybe too many have been requested?");
 		return 0;
 	}
 	for (int i = 0; i < chip_num_channels; i++)
 	{
-		chip_channel *ch = &chip_channels[i];
-		ch->period = 1;
-		ch->mutex = al_create_mutex();
-		ch->wave_data = (uint16_t *)malloc(sizeof(uint16_t));
-		ch->wave_len = 1;
-		ch->own_wave = 1;
-		ch->noise_tap = 7;
-		ch->noise_state = 0x0001;
-		al_unlock_mutex(ch->mutex);
+		if (!chip_channel_defaults(&chip_channels[i], &chip_channel_states[i]))
+		{
+			// chip_shutdown releases the whole array
+			chip_log_error("Couldn't malloc for channel waves.");
+			return 0;
+		}
+	}
+
+	chip_log_info("Created channel states at %p",(void *)chip_channels);
+	return 1;
+}
+
+static int chip_setup(void)
+{
+	if (!chip_arg_sanity())
+	{
+		return 0;
+	}
+	if (chip_is_offline)
+	{
+		// Only the core, for mutexes; no audio addon or device
+		if (!al_is_system_installed() && !al_init())
+		{
+			chip_log_error("Could not initialize Allegro.");
+			return 0;
+		}
+	}
+	else if (!chip_allegro_setup())
+	{
+		return 0;
+	}
+	if (!chip_channel_init())
+	{
+		return 0;
+	}
+
+	// Set up defaults for audio engine pointer
+	chip_engine_ptr = NULL;
+	chip_engine_cnt = 0;
+	chip_engine_period = (unsigned int)(chip_rate / 60.00); // Default to 60Hz
+
+	// Guards sample teardown against the sample thread
+	chip_sample_mutex = al_create_mutex();
+	chip_sample_cond = al_create_cond();
+
+	// Hand-off point for chip_reconfigure and chip_resize_channels
+	chip_config_mutex = al_create_mutex();
+	chip_config_cond = al_create_cond();
+
+	// Offline, chip_render does the work of both threads
+	if (chip_is_offline)
+	{
+		return 1;
 	}
 
-	printf("[audio] Created channel states at %X\n",(uint16_t)chip_channels);
+	// Build the thread
+	chip_thread = al_create_thread(chip_func, NULL);
+	chip_log_info("Created audio thread.");
+
+	// Sample thread keeps file-backed sample channels read ahead
+	chip_sample_thread = al_create_thread(chip_sample_func, NULL);
+	chip_log_info("Created sample thread.");
+
 	return 1;
 }
 
@@ -199,40 +381,150 @@ void chip_init(unsigned int rate, unsigned int num_channels, unsigned int frag_s
 	chip_frag_num = frag_num;
 	chip_rate_mul = rate_mul;
 	
-	if (!chip_arg_sanity())
+	chip_is_init = chip_setup();
+	chip_log_flush();
+}
+
+void chip_start(void)
+{
+	if (!chip_is_init)
 	{
+		chip_log_error("LibChip has not been initialized.");
+		chip_log_flush();
 		return;
 	}
-	if (!chip_allegro_setup())
+	if (chip_is_started)
 	{
 		return;
 	}
-	if (!chip_channel_init())
+	if (chip_is_offline)
 	{
+		chip_log_error("Offline instances are rendered with chip_render.");
+		chip_log_flush();
 		return;
 	}
+	chip_rt_begin();
+	if (chip_rt_lock_mem)
+	{
+		chip_rt_lock_memory();
+		chip_lock_buffers();
+	}
+	// Set before any thread runs, so swapped-out waves and samples wait
+	// for the renderer from here on
+	chip_is_started = 1;
+	al_start_thread(chip_sample_thread);
+	if (chip_ahead_depth)
+	{
+		// Prime the ring so the first fragment events are already covered
+		chip_ahead_fill();
+		al_start_thread(chip_render_thread);
+		chip_log_info("Started render thread, %d fragments ahead.",chip_ahead_depth);
+	}
+	al_start_thread(chip_thread);
+	chip_log_info("Started audio thread.");
+	// Report only what the rendering threads managed to set up
+	chip_rt_wait(chip_ahead_depth ? 2 : 1);
+	chip_log_flush();
+}
 
-	// Set up defaults for audio engine pointer
-	chip_engine_ptr = NULL;
-	chip_engine_cnt = 0;
-	chip_engine_period = (unsigned int)(chip_rate / 60.00); // Default to 60Hz
+// Set up for rendering on demand with chip_render instead of to a device.
+// There's no voice, stream or audio thread, so this works with no audio
+// hardware, and the output depends only on the calls made beforehand.
+void chip_init_offline(unsigned int rate, unsigned int num_channels, unsigned int rate_mul)
+{
+	chip_shutdown();
 
-	// Build the thread
-	chip_thread = al_create_thread(chip_func, NULL);
-	printf("[audio] Created audio thread.\n");
+	chip_rate = rate;
+	chip_num_channels = num_channels;
+	chip_frag_size = CHIP_SIZE_FRAGMENT;
+	chip_frag_num = 1;
+	chip_rate_mul = rate_mul;
+	chip_is_offline = 1;
 
-	chip_is_init = 1;
+	chip_is_init = chip_setup();
+	chip_log_flush();
 }
 
-void chip_start(void)
+// Render frames of interleaved stereo audio into buf, on the calling
+// thread. Only for instances set up with chip_init_offline.
+void chip_render(int16_t *buf, unsigned int frames)
+{
+	if (!chip_is_init || !chip_is_offline)
+	{
+		chip_log_error("chip_render needs chip_init_offline.");
+		chip_log_flush();
+		return;
+	}
+	// The engine callback runs from here, as on the audio thread
+	chip_is_render_thread = 1;
+	while (frames)
+	{
+		// Top up file-backed rings a fragment at a time, as the sample
+		// thread would; offline, nothing else touches them
+		for (unsigned int i = 0; i < chip_num_channels; i++)
+		{
+			chip_sample *s = chip_channels[i].sample;
+			if (s)
+			{
+				chip_sample_fill(s);
+			}
+		}
+		unsigned int n = frames < chip_frag_size ? frames : chip_frag_size;
+		for (unsigned int i = 0; i < n; i++)
+		{
+			chip_step(buf + (2*i));
+		}
+		buf += 2*n;
+		frames -= n;
+	}
+	chip_is_render_thread = 0;
+	chip_retired_reap(0);
+	chip_log_flush();
+}
+
+// Render up to depth fragments ahead on a separate thread, so the fragment
+// event only has to copy finished audio. The engine callback then runs on
+// the render thread, and control changes are heard up to depth fragments
+// later. Must be called between chip_init and chip_start; 0 turns it off.
+void chip_set_render_ahead(unsigned int depth)
 {
 	if (!chip_is_init)
 	{
-		fprintf(stderr, "[audio] Error: LibChip has not been initialized.\n");
+		chip_log_error("LibChip has not been initialized.");
 		return;
 	}
-	al_start_thread(chip_thread);
-	printf("[audio] Started audio thread.\n");
+	if (chip_is_offline)
+	{
+		chip_log_error("Render-ahead needs an audio device.");
+		return;
+	}
+	if (chip_is_started)
+	{
+		chip_log_error("Render-ahead can't be changed after chip_start.");
+		return;
+	}
+	if (depth && chip_adapt_max)
+	{
+		chip_log_error("Render-ahead and adaptive fragments can't be combined.");
+		return;
+	}
+	chip_ahead_destroy();
+	if (!depth)
+	{
+		return;
+	}
+	chip_ahead_ring = (int16_t *)calloc(depth * chip_frag_size * 2, sizeof(int16_t));
+	if (!chip_ahead_ring)
+	{
+		chip_log_error("Couldn't malloc for render-ahead ring.");
+		return;
+	}
+	chip_ahead_mutex = al_create_mutex();
+	chip_ahead_cond = al_create_cond();
+	chip_render_thread = al_create_thread(chip_render_func, NULL);
+	chip_ahead_depth = depth;
+	chip_log_info("Render-ahead depth is %d fragments",depth);
+	chip_log_flush();
 }
 
 void chip_set_engine_ptr(void *ptr, unsigned int eng_period)
@@ -250,30 +542,272 @@ void *chip_get_engine_ptr(void)
 	return chip_engine_ptr;
 }
 
+// Let the audio thread pick the fragment size between min_size and
+// max_size from measured render cost and missed deadlines, halving or
+// doubling it at most every half second. A shrink that has to be undone
+// doubles the quiet time needed before the next one. The queued audio
+// plays out before each change. The fragment count stays as given
+// to chip_init. Must be called between chip_init and chip_start; a
+// max_size of 0 turns it off.
+void chip_set_adaptive(unsigned int min_size, unsigned int max_size)
+{
+	if (!chip_is_init)
+	{
+		chip_log_error("LibChip has not been initialized.");
+		return;
+	}
+	if (chip_is_offline)
+	{
+		chip_log_error("Adaptive fragments need an audio device.");
+		return;
+	}
+	if (chip_is_started)
+	{
+		chip_log_error("Adaptive fragments can't be changed after chip_start.");
+		return;
+	}
+	if (max_size && chip_ahead_depth)
+	{
+		chip_log_error("Render-ahead and adaptive fragments can't be combined.");
+		return;
+	}
+	if (!min_size)
+	{
+		min_size = 1;
+	}
+	if (max_size && max_size < min_size)
+	{
+		chip_log_error("Invalid adaptive fragment bounds (%d > %d)",min_size,max_size);
+		return;
+	}
+	chip_adapt_min = min_size;
+	chip_adapt_max = max_size;
+	chip_adapt_misses = 0;
+	chip_adapt_load = 0.0f;
+	if (!max_size)
+	{
+		return;
+	}
+	// Start from the configured size, pulled into bounds
+	unsigned int size = chip_frag_size;
+	if (size < min_size)
+	{
+		size = min_size;
+	}
+	else if (size > max_size)
+	{
+		size = max_size;
+	}
+	if (size != chip_frag_size)
+	{
+		chip_stream_destroy();
+		chip_frag_size = size;
+		if (!chip_stream_setup())
+		{
+			return;
+		}
+	}
+	chip_adapt_begin();
+	chip_log_info("Adaptive fragment size between %d and %d",min_size,max_size);
+	chip_log_flush();
+}
+
+// Change the sample rate, fragment geometry or oversampling while running.
+// Zero keeps the current value. The voice, mixer, threads and channel state
+// all survive, and channel periods and the engine period are rescaled so
+// pitch and tempo hold. A new rate or fragment geometry still needs a new
+// Allegro stream, which the audio thread swaps in between fragments; the
+// mixer resamples rates other than the voice's. The old stream plays out
+// what it has queued first, but the new one starts empty, so a stream
+// change leaves a gap of about one fragment. A rate multiplier change
+// alone is seamless. With render-ahead on, only the oversample factor can
+// change. Not callable from the engine callback.
+void chip_reconfigure(unsigned int rate, unsigned int frag_size, unsigned int frag_num, unsigned int rate_mul)
+{
+	if (!chip_is_init)
+	{
+		chip_log_error("LibChip has not been initialized.");
+		return;
+	}
+	if (chip_is_render_thread)
+	{
+		// The renderer would be waiting on itself
+		chip_log_error("Configuration can't change from the engine callback.");
+		return;
+	}
+	chip_config *c = &chip_config_next;
+	c->rate = rate ? rate : chip_rate;
+	c->frag_size = frag_size ? frag_size : chip_frag_size;
+	c->frag_num = frag_num ? frag_num : chip_frag_num;
+	c->rate_mul = rate_mul ? rate_mul : chip_rate_mul;
+	c->channel_block = NULL;
+	if (chip_ahead_depth && (c->rate != chip_rate || c->frag_size != chip_frag_size || c->frag_num != chip_frag_num))
+	{
+		chip_log_error("Only the rate multiplier can change with render-ahead on.");
+		return;
+	}
+	if (!chip_config_commit())
+	{
+		chip_log_error("Audio thread didn't take the new configuration in time.");
+	}
+	chip_log_flush();
+}
+
+// Grow or shrink the channel array without stopping playback. Existing
+// channels keep their state; new ones start at power-on defaults. Not
+// callable from the engine callback.
+void chip_resize_channels(unsigned int num_channels)
+{
+	if (!chip_is_init)
+	{
+		chip_log_error("LibChip has not been initialized.");
+		return;
+	}
+	if (chip_is_render_thread)
+	{
+		// The renderer would be waiting on itself
+		chip_log_error("Configuration can't change from the engine callback.");
+		return;
+	}
+	if (!num_channels)
+	{
+		chip_log_error("At least one channel must be created.");
+		return;
+	}
+	if (num_channels == chip_num_channels)
+	{
+		return;
+	}
+	chip_config *c = &chip_config_next;
+	c->channel_block = chip_channel_alloc(num_channels, &c->channels, &c->channel_states);
+	if (!c->channel_block)
+	{
+		chip_log_error("Couldn't malloc for channel states. Maybe too many have been requested?");
+		return;
+	}
+	for (unsigned int i = chip_num_channels; i < num_channels; i++)
+	{
+		if (!chip_channel_defaults(&c->channels[i], &c->channel_states[i]))
+		{
+			chip_log_error("Couldn't malloc for channel waves.");
+			for (unsigned int j = chip_num_channels; j <= i; j++)
+			{
+				chip_wave_pool_destroy(&c->channels[j]);
+			}
+			chip_channel_free(c->channel_block, num_channels);
+			c->channel_block = NULL;
+			return;
+		}
+	}
+
+	c->rate = chip_rate;
+	c->frag_size = chip_frag_size;
+	c->frag_num = chip_frag_num;
+	c->rate_mul = chip_rate_mul;
+	c->num_channels = num_channels;
+	if (!chip_config_commit())
+	{
+		chip_log_error("Audio thread didn't take the new channel count in time.");
+		for (unsigned int i = chip_num_channels; i < num_channels; i++)
+		{
+			chip_wave_pool_destroy(&c->channels[i]);
+		}
+		chip_channel_free(c->channel_block, num_channels);
+		c->channel_block = NULL;
+		chip_log_flush();
+		return;
+	}
+
+	// Wait out a sample thread pass that may still be reading the old array
+	al_lock_mutex(chip_sample_mutex);
+	al_unlock_mutex(chip_sample_mutex);
+	for (unsigned int i = num_channels; i < c->old_num_channels; i++)
+	{
+		chip_channel_release(&c->old_channels[i]);
+	}
+	chip_channel_free(c->old_channel_block, c->old_num_channels);
+	c->old_channel_block = NULL;
+	c->old_channels = NULL;
+	c->old_num_channels = 0;
+	chip_log_flush();
+}
+
+// Run the rendering threads (the audio thread, and the render thread with
+// render-ahead on) under SCHED_FIFO or SCHED_RR at the given priority,
+// pinned to the CPUs set in cpu_mask. With render-ahead on, the audio
+// thread runs one step above the render thread. With lock_mem set, the
+// buffers the renderer reads (channels, waves, samples and their rings,
+// the render-ahead ring) are locked in memory from chip_start until
+// chip_shutdown, and the threads prefault their stacks. The rest of the
+// process is left alone. Anything the
+// system refuses is logged and left at its default; chip_get_realtime
+// reports what took effect once chip_start returns. Must be called
+// between chip_init and chip_start.
+void chip_set_realtime(unsigned int policy, int priority, uint64_t cpu_mask, unsigned int lock_mem)
+{
+	if (!chip_is_init)
+	{
+		chip_log_error("LibChip has not been initialized.");
+		return;
+	}
+	if (chip_is_offline)
+	{
+		chip_log_error("Real-time settings need an audio device.");
+		return;
+	}
+	if (chip_is_started)
+	{
+		chip_log_error("Real-time settings can't be changed after chip_start.");
+		return;
+	}
+	if (policy > CHIP_RT_SCHED_RR)
+	{
+		chip_log_error("Unknown scheduling policy %d",policy);
+		return;
+	}
+	chip_rt_policy = policy;
+	chip_rt_priority = priority;
+	chip_rt_cpus = cpu_mask;
+	chip_rt_lock_mem = lock_mem;
+}
+
+// Period that plays a wave of len steps at f Hz. Resulting frequency:
+// (rate_mul * rate) / (wave_len * period). Clamped before the conversion,
+// which is undefined for values out of range; NaN becomes 1.
+uint32_t chip_freq_period(unsigned int len, float f)
+{
+	float p = (chip_rate_mul * chip_rate) / (len * f);
+	if (!(p >= 1.0f))
+	{
+		return 1;
+	}
+	if (p >= 4294967296.0f)
+	{
+		return UINT32_MAX;
+	}
+	return (uint32_t)p;
+}
+
 /* External control fuctions */
 void chip_set_freq(unsigned int channel, float f)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return;
 	}
 	chip_channel *ch = &chip_channels[channel];
-// Resulting frequency: (rate_mul * rate) / (wave_len * period)
-	unsigned int set_p = (unsigned int)((chip_rate_mul * chip_rate) / (ch->wave_len * f));
-	if (set_p < 1)
-	{
-		set_p = 1;
-	}
+	const chip_wave *w = __atomic_load_n(&ch->wave, __ATOMIC_ACQUIRE);
+	uint32_t set_p = chip_freq_period(w->len, f);
 	ch->period = set_p;
-	printf("[audio] Set channel %d period to %d\n",channel,set_p);
+	chip_log_debug("Set channel %d period to %d",channel,set_p);
 }
 
 void chip_set_period_direct(unsigned int channel, unsigned int period)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return;
 	}
 	chip_channel *ch = &chip_channels[channel];
@@ -288,7 +822,7 @@ void chip_set_amp(unsigned int channel, unsigned int amp_l, unsigned int amp_r)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return;
 	}
 	chip_channel *ch = &chip_channels[channel];
@@ -300,7 +834,7 @@ void chip_set_noise(unsigned int channel, unsigned int noise_en)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return;
 	}
 	chip_channel *ch = &chip_channels[channel];
@@ -311,7 +845,7 @@ void chip_set_loop(unsigned int channel, unsigned int loop_en)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return;
 	}
 	chip_channel *ch = &chip_channels[channel];
@@ -323,22 +857,16 @@ void chip_set_wave(unsigned int channel, uint16_t *wave_data, unsigned int len,
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return;
 	}
 	chip_channel *ch = &chip_channels[channel];
-	al_lock_mutex(ch->mutex);
-	// Clear out the previous wave if we own it
-	if (ch->own_wave && ch->wave_data)
+	if (!chip_wave_swap(ch, wave_data, len, NULL))
 	{
-		free(ch->wave_data);
-		ch->wave_data = NULL;
+		chip_log_error("Renderer stalled; wave change on channel %d dropped",channel);
+		return;
 	}
-	ch->wave_data = wave_data;
-	ch->wave_len = len;
 	ch->loop_en = loop_en;
-	ch->own_wave = 0;
-	al_unlock_mutex(ch->mutex);
 }
 
 // Create a buffer for wave data owned by the library
@@ -346,45 +874,45 @@ void chip_create_wave(unsigned int channel, unsigned int len, unsigned int loop_
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return;
 	}
 	chip_channel *ch = &chip_channels[channel];
-	al_lock_mutex(ch->mutex);
 	if (!len)
 	{
-		fprintf(stderr,"[audio] Error: Wave length of 0 specified. The engine may crash.\n");
+		chip_log_error("Wave length of 0 specified. The engine may crash.");
+		return;
+	}
+	chip_wave_buf *b = chip_wave_buf_create(len);
+	if (!b)
+	{
+		chip_log_error("Couldn't malloc for wave on channel %d",channel);
 		return;
 	}
-	// Clear out the previous wave if we own it
-	if (ch->own_wave && ch->wave_data)
+	if (!chip_wave_swap(ch, b->data, len, b))
 	{
-		free(ch->wave_data);
-		ch->wave_data = NULL;
+		chip_log_error("Renderer stalled; wave change on channel %d dropped",channel);
+		return;
 	}
-	ch->wave_data = (uint16_t *)calloc(len,sizeof(uint16_t));
-	ch->own_wave = 1;
-	ch->wave_len = len;
 	ch->loop_en = loop_en;
-	al_unlock_mutex(ch->mutex);
 }
 
 void chip_set_wave_pos(unsigned int channel, unsigned int pos)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return;
 	}
-	chip_channel *ch = &chip_channels[channel];
-	ch->wave_pos = pos;
+	chip_channel_state *st = &chip_channel_states[channel];
+	st->wave_pos = pos;
 }
 
 void chip_set_noise_tap(unsigned int channel, unsigned int tap)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return;
 	}
 	chip_channel *ch = &chip_channels[channel];
@@ -395,11 +923,136 @@ void chip_set_noise_tap(unsigned int channel, unsigned int tap)
 	ch->noise_tap = tap;
 }
 
+// Swap a new sample source onto a channel; NULL returns it to wave/noise
+static void chip_sample_attach(unsigned int channel, chip_sample *s)
+{
+	chip_channel *ch = &chip_channels[channel];
+	// The renderer resets its state when it first picks up s. Closing the
+	// old file can block; leave it to the sample thread.
+	chip_sample_retire(__atomic_exchange_n(&ch->sample, s, __ATOMIC_SEQ_CST));
+}
+
+static chip_sample *chip_sample_create(unsigned int format, unsigned int loop_en)
+{
+	if (format < CHIP_SAMPLE_DPCM4 || format > CHIP_SAMPLE_PCM16)
+	{
+		chip_log_error("Unknown sample format %d",format);
+		return NULL;
+	}
+	chip_sample *s = (chip_sample *)calloc(1,sizeof(chip_sample));
+	if (!s)
+	{
+		chip_log_error("Couldn't malloc for sample state.");
+		return NULL;
+	}
+	chip_rt_lock(s, sizeof(chip_sample));
+	s->format = format;
+	s->loop_en = loop_en;
+	return s;
+}
+
+// Play user-owned sample data straight from memory
+void chip_set_sample_mem(unsigned int channel, const void *data, unsigned int len, unsigned int format, unsigned int loop_en)
+{
+	if (channel >= chip_num_channels)
+	{
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
+		return;
+	}
+	if (!data || !len)
+	{
+		chip_log_error("Empty sample specified.");
+		return;
+	}
+	chip_sample *s = chip_sample_create(format, loop_en);
+	if (!s)
+	{
+		return;
+	}
+	s->mem = (const uint8_t *)data;
+	s->mem_len = len;
+	chip_sample_attach(channel, s);
+}
+
+// Stream sample data from a file, starting offset bytes in. Opening and
+// priming the file blocks on disk, so this isn't callable from the engine
+// callback; start memory samples there instead.
+void chip_set_sample_file(unsigned int channel, const char *path, long offset, unsigned int format, unsigned int loop_en)
+{
+	if (channel >= chip_num_channels)
+	{
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
+		return;
+	}
+	if (chip_is_render_thread)
+	{
+		chip_log_error("Sample files can't be opened from the engine callback.");
+		return;
+	}
+	chip_sample *s = chip_sample_create(format, loop_en);
+	if (!s)
+	{
+		return;
+	}
+	s->offset = offset;
+	s->file = fopen(path, "rb");
+	if (!s->file || fseek(s->file, offset, SEEK_SET) != 0)
+	{
+		chip_log_error("Couldn't open sample file %s",path);
+		chip_sample_destroy(s);
+		return;
+	}
+	s->ring = (uint8_t *)malloc(CHIP_SAMPLE_CHUNKS * CHIP_SAMPLE_CHUNK_SIZE);
+	if (!s->ring)
+	{
+		chip_log_error("Couldn't malloc for sample ring.");
+		chip_sample_destroy(s);
+		return;
+	}
+	chip_rt_lock(s->ring, CHIP_SAMPLE_CHUNKS * CHIP_SAMPLE_CHUNK_SIZE);
+	// Prime the ring here so playback starts without waiting on the thread
+	chip_sample_fill(s);
+	if (!s->head)
+	{
+		chip_log_error("Sample file %s is empty.",path);
+		chip_sample_destroy(s);
+		return;
+	}
+	chip_sample_attach(channel, s);
+}
+
+// Set the rate at which sample data is consumed, in samples per second
+void chip_set_sample_rate(unsigned int channel, float f)
+{
+	if (channel >= chip_num_channels)
+	{
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
+		return;
+	}
+	chip_channel *ch = &chip_channels[channel];
+	unsigned int set_p = (unsigned int)((chip_rate_mul * chip_rate) / f);
+	if (set_p < 1)
+	{
+		set_p = 1;
+	}
+	ch->period = set_p;
+}
+
+void chip_stop_sample(unsigned int channel)
+{
+	if (channel >= chip_num_channels)
+	{
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
+		return;
+	}
+	chip_sample_attach(channel, NULL);
+}
+
 unsigned int chip_get_period(unsigned int channel)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return 0;
 	}
 	chip_channel *ch = &chip_channels[channel];
@@ -409,7 +1062,7 @@ unsigned int chip_get_amp(unsigned int channel, unsigned int side)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return 0;
 	}
 	chip_channel *ch = &chip_channels[channel];
@@ -420,7 +1073,7 @@ unsigned int chip_get_noise(unsigned int channel)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return 0;
 	}
 	chip_channel *ch = &chip_channels[channel];
@@ -431,7 +1084,7 @@ unsigned int chip_get_loop(unsigned int channel)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return 0;
 	}
 	chip_channel *ch = &chip_channels[channel];
@@ -442,29 +1095,29 @@ uint16_t *chip_get_wave(unsigned int channel)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return NULL;
 	}
 	chip_channel *ch = &chip_channels[channel];
-	return ch->wave_data;
+	return __atomic_load_n(&ch->wave, __ATOMIC_ACQUIRE)->data;
 }
 
 unsigned int chip_get_wave_len(unsigned int channel)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return 0;
 	}
 	chip_channel *ch = &chip_channels[channel];
-	return ch->wave_len;
+	return __atomic_load_n(&ch->wave, __ATOMIC_ACQUIRE)->len;
 }
 
 chip_channel *chip_get_channel(unsigned int channel)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return 0;
 	}
 	return &chip_channels[channel];
@@ -474,21 +1127,102 @@ unsigned int chip_get_wave_pos(unsigned int channel)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return 0;
 	}
-	chip_channel *ch = &chip_channels[channel];
-	return ch->wave_pos;
+	chip_channel_state *st = &chip_channel_states[channel];
+	return st->wave_pos;
 }
 
 unsigned int chip_get_noise_tap(unsigned int channel)
 {
 	if (channel >= chip_num_channels)
 	{
-		fprintf(stderr,"[audio] Error: Channel out of range (%d > %d)\n",channel,chip_num_channels);
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
 		return 0;
 	}
 	chip_channel *ch = &chip_channels[channel];
 	return ch->noise_tap;
 	
 }
+
+unsigned int chip_get_sample_playing(unsigned int channel)
+{
+	if (channel >= chip_num_channels)
+	{
+		chip_log_error("Channel out of range (%d > %d)",channel,chip_num_channels);
+		return 0;
+	}
+	chip_sample *s = chip_sample_peek(&chip_channels[channel]);
+	unsigned int playing = s && !s->done;
+	chip_sample_unpeek();
+	return playing;
+}
+
+// Number of fragments currently rendered and waiting for the stream
+unsigned int chip_get_render_ahead(void)
+{
+	if (!chip_ahead_depth)
+	{
+		return 0;
+	}
+	return chip_atomic_load(&chip_ahead_head) - chip_atomic_load(&chip_ahead_tail);
+}
+
+unsigned int chip_get_render_misses(void)
+{
+	return chip_ahead_misses;
+}
+
+unsigned int chip_get_frag_size(void)
+{
+	return chip_frag_size;
+}
+
+unsigned int chip_get_adaptive_misses(void)
+{
+	return chip_adapt_misses;
+}
+
+// Worst fraction of a fragment's playback time spent rendering it, over
+// the last adaptive window
+float chip_get_render_load(void)
+{
+	return chip_adapt_load;
+}
+
+// Bytes the library currently has allocated: the channel block, wave
+// descriptors and owned waves, sample state and read-ahead rings, whatever
+// was swapped out and isn't freed yet, the render-ahead ring, and the
+// fixed log and update queues. Allegro's own buffers are not included.
+size_t chip_get_memory_footprint(void)
+{
+	size_t total = chip_log_footprint() + chip_update_footprint();
+	total += __atomic_load_n(&chip_retired_bytes, __ATOMIC_RELAXED);
+	if (!chip_channel_block)
+	{
+		return total;
+	}
+	total += chip_channel_block_size(chip_num_channels);
+	for (unsigned int i = 0; i < chip_num_channels; i++)
+	{
+		chip_channel *ch = &chip_channels[i];
+		total += chip_wave_pool_footprint(ch);
+		chip_sample *s = chip_sample_peek(ch);
+		if (s)
+		{
+			total += chip_sample_size(s);
+		}
+		chip_sample_unpeek();
+	}
+	if (chip_ahead_ring)
+	{
+		total += chip_ahead_depth * chip_frag_size * 2 * sizeof(int16_t);
+	}
+	return total;
+}
+
+unsigned int chip_get_realtime(void)
+{
+	return chip_atomic_load(&chip_rt_applied);
+}
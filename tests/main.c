@@ -0,0 +1,432 @@
+// LibChip golden output tests
+// Renders a fixed corpus of scenarios offline, hashes each buffer and
+// compares it against the checked-in golden file, along with a render time
+// budget per scenario.
+//
+// Usage: chiptest [-u] [-t tolerance] golden.txt
+//   -u  rewrite golden.txt from this build instead of checking it
+//   -t  fail a scenario that renders more than tolerance times slower
+//       than its baseline (default 3)
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libchip.h>
+
+#define TEST_RATE 44100
+#define TEST_FRAMES 44100 // One second per scenario
+#define TEST_RUNS 5 // Renders per scenario; all must hash the same
+#define TEST_MAX_SCENARIOS 64
+#define TEST_NAME_LEN 32
+
+// Wavetables from the waveforms example
+static uint16_t wave_tri[] = {
+	0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7,
+	0x8, 0x9, 0xA, 0xB, 0xC, 0xD, 0xE, 0xF,
+	0xF, 0xE, 0xD, 0xC, 0xB, 0xA, 0x9, 0x8,
+	0x7, 0x6, 0x5, 0x4, 0x3, 0x2, 0x1, 0x0,
+};
+
+static uint16_t wave_50[] = {
+	0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+	0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+	0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF,
+	0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF
+};
+
+static uint16_t wave_saw[] = {
+	0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,
+	8,8,9,9,10,10,11,11,12,12,13,13,14,14,15,15
+};
+
+static uint16_t wave_funk[] = {
+	0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+	0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0xF, 0xF,
+	0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+	0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+	0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF,
+	0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF,
+	0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF,
+	0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF
+};
+
+// One scenario: set up a chip offline, then render TEST_FRAMES from it
+typedef struct test_scenario test_scenario;
+struct test_scenario
+{
+	char name[TEST_NAME_LEN];
+	void (*setup)(const test_scenario *t);
+	void (*midway)(const test_scenario *t); // If set, called halfway through the render
+	unsigned int arg; // Tap, rate multiplier, loop enable, ...
+};
+
+// What the golden file says about a scenario
+typedef struct test_golden test_golden;
+struct test_golden
+{
+	char name[TEST_NAME_LEN];
+	uint32_t hash;
+	double ns_per_frame;
+};
+
+static test_scenario scenarios[TEST_MAX_SCENARIOS];
+static unsigned int num_scenarios;
+static int16_t buf[TEST_FRAMES * 2];
+static unsigned int env_amp;
+static uint8_t sample_data[2048];
+
+static void setup_wave(const test_scenario *t)
+{
+	static uint16_t *waves[] = { wave_tri, wave_50, wave_saw, wave_funk };
+	static unsigned int lens[] = { 32, 32, 32, 64 };
+	chip_init_offline(TEST_RATE, 1, 8);
+	chip_set_wave(0, waves[t->arg], lens[t->arg], 1);
+	chip_set_amp(0, 0xF, 0xF);
+	chip_set_freq(0, 440.0f);
+}
+
+static void setup_noise(const test_scenario *t)
+{
+	chip_init_offline(TEST_RATE, 1, 8);
+	chip_set_noise(0, 1);
+	chip_set_noise_tap(0, t->arg);
+	chip_set_period_direct(0, 40);
+	chip_set_amp(0, 0xF, 0x8);
+}
+
+// A slow wave that plays out well within the render when it doesn't loop
+static void setup_loop(const test_scenario *t)
+{
+	chip_init_offline(TEST_RATE, 1, 1);
+	chip_set_wave(0, wave_saw, 32, t->arg);
+	chip_set_amp(0, 0xF, 0xF);
+	chip_set_freq(0, 4.0f);
+}
+
+static void setup_rate_mul(const test_scenario *t)
+{
+	chip_init_offline(TEST_RATE, 2, t->arg);
+	chip_set_wave(0, wave_tri, 32, 1);
+	chip_set_amp(0, 0xF, 0xF);
+	// Periods that don't scale evenly with the multiplier, so each one
+	// renders differently
+	chip_set_freq(0, 220.0f);
+	chip_set_noise(1, 1);
+	chip_set_period_direct(1, 7);
+	chip_set_amp(1, 0x4, 0x4);
+}
+
+static void test_envelope(void)
+{
+	chip_set_amp(0, 0xF - (env_amp % 16), env_amp % 16);
+	env_amp++;
+}
+
+// Every wave on its own channel plus noise, with an engine callback
+// stepping an envelope, as a game would drive it
+static void setup_mix(const test_scenario *t)
+{
+	chip_init_offline(TEST_RATE, 5, 16);
+	chip_set_wave(0, wave_tri, 32, 1);
+	chip_set_wave(1, wave_50, 32, 1);
+	chip_set_wave(2, wave_saw, 32, 1);
+	chip_set_wave(3, wave_funk, 64, 1);
+	chip_set_noise(4, 1);
+	chip_set_noise_tap(4, 1);
+	chip_set_period_direct(4, 100);
+	for (unsigned int i = 0; i < 5; i++)
+	{
+		chip_set_amp(i, 0xA, 0xA);
+		if (i < 4)
+		{
+			chip_set_freq(i, 110.0f * (i + 1));
+		}
+	}
+	env_amp = 0;
+	chip_set_engine_ptr(test_envelope, TEST_RATE / 60);
+}
+
+// A sample played from memory over a quiet wave. PCM8 loops a ramp with
+// a kink in it; DPCM4 plays a run of deltas once and ends mid-render.
+static void setup_sample(const test_scenario *t)
+{
+	for (unsigned int i = 0; i < sizeof(sample_data); i++)
+	{
+		if (t->arg == CHIP_SAMPLE_PCM8)
+		{
+			sample_data[i] = (uint8_t)(64 + (i * 3) % 128 + ((i & 64) ? 16 : 0));
+		}
+		else
+		{
+			sample_data[i] = (uint8_t)(i * 37 + 11);
+		}
+	}
+	chip_init_offline(TEST_RATE, 2, 4);
+	chip_set_sample_mem(0, sample_data, sizeof(sample_data), t->arg, t->arg == CHIP_SAMPLE_PCM8);
+	chip_set_sample_rate(0, 8000.0f);
+	chip_set_amp(0, 0xF, 0xC);
+	chip_set_wave(1, wave_tri, 32, 1);
+	chip_set_amp(1, 0x3, 0x3);
+	chip_set_freq(1, 330.0f);
+}
+
+static void queue_chord(uint16_t *const *waves, const float *freqs, unsigned int amp)
+{
+	chip_update u[3];
+	memset(u, 0, sizeof(u));
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		u[i].channel = i;
+		u[i].mask = CHIP_UPDATE_WAVE | CHIP_UPDATE_LOOP | CHIP_UPDATE_FREQ | CHIP_UPDATE_AMP;
+		u[i].wave_data = waves[i];
+		u[i].wave_len = 32;
+		u[i].loop_en = 1;
+		u[i].freq = freqs[i];
+		u[i].amplitude[0] = amp;
+		u[i].amplitude[1] = amp - i;
+	}
+	chip_update_channels(u, 3);
+}
+
+// A chord queued as one batch, then changed for another halfway through
+static void setup_chord(const test_scenario *t)
+{
+	static uint16_t *const waves[] = { wave_tri, wave_saw, wave_50 };
+	static const float freqs[] = { 261.63f, 329.63f, 392.0f };
+	chip_init_offline(TEST_RATE, 3, 8);
+	queue_chord(waves, freqs, 0xC);
+}
+
+static void change_chord(const test_scenario *t)
+{
+	static uint16_t *const waves[] = { wave_saw, wave_50, wave_tri };
+	static const float freqs[] = { 220.0f, 261.63f, 329.63f };
+	queue_chord(waves, freqs, 0xA);
+}
+
+static test_scenario *add_scenario(const char *name, void (*setup)(const test_scenario *t), unsigned int arg)
+{
+	test_scenario *t = &scenarios[num_scenarios++];
+	snprintf(t->name, sizeof(t->name), "%s", name);
+	t->setup = setup;
+	t->midway = NULL;
+	t->arg = arg;
+	return t;
+}
+
+static void build_corpus(void)
+{
+	char name[TEST_NAME_LEN];
+	add_scenario("wave_tri", setup_wave, 0);
+	add_scenario("wave_50", setup_wave, 1);
+	add_scenario("wave_saw", setup_wave, 2);
+	add_scenario("wave_funk", setup_wave, 3);
+	for (unsigned int tap = 0; tap < 16; tap++)
+	{
+		snprintf(name, sizeof(name), "noise_tap_%d", tap);
+		add_scenario(name, setup_noise, tap);
+	}
+	add_scenario("wave_oneshot", setup_loop, 0);
+	add_scenario("wave_loop", setup_loop, 1);
+	static const unsigned int muls[] = { 1, 4, 32, 512 };
+	for (unsigned int i = 0; i < sizeof(muls) / sizeof(muls[0]); i++)
+	{
+		snprintf(name, sizeof(name), "rate_mul_%d", muls[i]);
+		add_scenario(name, setup_rate_mul, muls[i]);
+	}
+	add_scenario("mix_engine", setup_mix, 0);
+	add_scenario("sample_pcm8", setup_sample, CHIP_SAMPLE_PCM8);
+	add_scenario("sample_dpcm4", setup_sample, CHIP_SAMPLE_DPCM4);
+	add_scenario("batch_chord", setup_chord, 0)->midway = change_chord;
+}
+
+// FNV-1a over the rendered bytes
+static uint32_t hash_buf(const int16_t *p, size_t frames)
+{
+	const uint8_t *b = (const uint8_t *)p;
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < frames * 2 * sizeof(int16_t); i++)
+	{
+		h ^= b[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Render a scenario TEST_RUNS times from scratch. Returns 0 if the runs
+// disagree, which means output depends on more than the calls made.
+static int run_scenario(const test_scenario *t, uint32_t *hash, double *ns_per_frame)
+{
+	double best = 0.0;
+	for (unsigned int run = 0; run < TEST_RUNS; run++)
+	{
+		t->setup(t);
+		double start = now();
+		if (t->midway)
+		{
+			chip_render(buf, TEST_FRAMES / 2);
+			t->midway(t);
+			chip_render(buf + (TEST_FRAMES / 2) * 2, TEST_FRAMES - TEST_FRAMES / 2);
+		}
+		else
+		{
+			chip_render(buf, TEST_FRAMES);
+		}
+		double took = now() - start;
+		uint32_t h = hash_buf(buf, TEST_FRAMES);
+		chip_shutdown();
+		if (run && h != *hash)
+		{
+			return 0;
+		}
+		*hash = h;
+		if (!run || took < best)
+		{
+			best = took;
+		}
+	}
+	*ns_per_frame = best * 1e9 / TEST_FRAMES;
+	return 1;
+}
+
+static unsigned int load_golden(const char *path, test_golden *golden)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+	{
+		return 0;
+	}
+	char line[128];
+	unsigned int n = 0;
+	while (n < TEST_MAX_SCENARIOS && fgets(line, sizeof(line), f))
+	{
+		test_golden *g = &golden[n];
+		if (line[0] == '#')
+		{
+			continue;
+		}
+		if (sscanf(line, "%31s %x %lf", g->name, &g->hash, &g->ns_per_frame) == 3)
+		{
+			n++;
+		}
+	}
+	fclose(f);
+	return n;
+}
+
+static const test_golden *find_golden(const test_golden *golden, unsigned int n, const char *name)
+{
+	for (unsigned int i = 0; i < n; i++)
+	{
+		if (!strcmp(golden[i].name, name))
+		{
+			return &golden[i];
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int update = 0;
+	double tolerance = 3.0;
+	const char *path = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-u"))
+		{
+			update = 1;
+		}
+		else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+		{
+			tolerance = atof(argv[++i]);
+		}
+		else
+		{
+			path = argv[i];
+		}
+	}
+	if (!path || tolerance <= 0.0)
+	{
+		fprintf(stderr, "usage: %s [-u] [-t tolerance] golden.txt\n", argv[0]);
+		return 2;
+	}
+
+	chip_set_log_level(CHIP_LOG_WARN);
+	build_corpus();
+	static test_golden golden[TEST_MAX_SCENARIOS];
+	unsigned int num_golden = update ? 0 : load_golden(path, golden);
+	if (!update && !num_golden)
+	{
+		fprintf(stderr, "chiptest: no golden hashes in %s\n", path);
+		return 2;
+	}
+	FILE *out = NULL;
+	if (update)
+	{
+		out = fopen(path, "w");
+		if (!out)
+		{
+			perror("chiptest: golden file");
+			return 2;
+		}
+		fprintf(out, "# scenario, FNV-1a of %d stereo frames at %dHz, baseline ns/frame\n", TEST_FRAMES, TEST_RATE);
+	}
+
+	unsigned int failed = 0;
+	for (unsigned int i = 0; i < num_scenarios; i++)
+	{
+		const test_scenario *t = &scenarios[i];
+		uint32_t hash = 0;
+		double ns = 0.0;
+		if (!run_scenario(t, &hash, &ns))
+		{
+			printf("FAIL %-16s renders differ between identical runs\n", t->name);
+			failed++;
+			continue;
+		}
+		if (update)
+		{
+			fprintf(out, "%s %08x %.1f\n", t->name, hash, ns);
+			printf("     %-16s %08x %8.1f ns/frame\n", t->name, hash, ns);
+			continue;
+		}
+		const test_golden *g = find_golden(golden, num_golden, t->name);
+		if (!g)
+		{
+			printf("FAIL %-16s no golden hash\n", t->name);
+			failed++;
+		}
+		else if (g->hash != hash)
+		{
+			printf("FAIL %-16s hash %08x, expected %08x\n", t->name, hash, g->hash);
+			failed++;
+		}
+		else if (ns > g->ns_per_frame * tolerance)
+		{
+			printf("FAIL %-16s %.1f ns/frame, over %.1fx the %.1f baseline\n", t->name, ns, tolerance, g->ns_per_frame);
+			failed++;
+		}
+		else
+		{
+			printf("ok   %-16s %08x %8.1f ns/frame (baseline %.1f)\n", t->name, hash, ns, g->ns_per_frame);
+		}
+	}
+	if (out)
+	{
+		fclose(out);
+	}
+	chip_log_flush();
+	printf("%d of %d scenarios failed\n", failed, num_scenarios);
+	return failed ? 1 : 0;
+}